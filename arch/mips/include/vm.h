@@ -113,9 +113,106 @@ paddr_t ram_getsize(void);
 paddr_t ram_getfirstfree(void);
 void  dumbvm_can_sleep(void);
 paddr_t getppages(unsigned long npages);
-paddr_t getfreeppages(unsigned long npages);
 int freeppages(paddr_t addr, unsigned long npages);
 
+/*
+ * Page out one user page, looking at no more than MAXSCAN frames for
+ * it, and return its (still allocated) frame, or 0 if none was found.
+ * The number of frames looked at is returned in SCANNED.
+ */
+paddr_t vm_evict(unsigned maxscan, unsigned *scanned);
+
+/*
+ * Page table side of page merging (see ksm.h and my_vm.c). Each
+ * works on a page held busy by the caller and returns false if the
+ * page can't be, or can no longer be, merged.
+ */
+struct addrspace;
+
+bool vm_ksmprotect(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+bool vm_ksmshare(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+bool vm_ksmreplace(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+		   paddr_t newpaddr);
+
+/*
+ * User stack size limit for MY_VM, in pages. The stack grows down on
+ * demand up to this size; vm_setstackmax changes the limit for stack
+ * growth from then on.
+ */
+#define VM_STACKMAXPAGES 256	/* 1M */
+
+void vm_setstackmax(unsigned npages);
+unsigned vm_getstackmax(void);
+
+/*
+ * Fault-around for MY_VM. When a TLB miss finds its page resident,
+ * vm_fault also loads the other resident pages of the same region in
+ * the aligned window of this many pages around it, so that a scan
+ * through memory takes one trap per window instead of one per page.
+ * 1 turns it off. At most VM_FAULTAROUND_MAX, so as not to flush too
+ * much of the TLB at once.
+ */
+#define VM_FAULTAROUND_DEFAULT	4
+#define VM_FAULTAROUND_MAX	16
+
+int vm_setfaultaround(unsigned npages);
+unsigned vm_getfaultaround(void);
+
+/*
+ * TLB management for MY_VM (vmtlb.c).
+ *
+ * vm_tlb_load loads the translation VADDR -> ELO for the active
+ * address space into the current cpu's TLB, replacing an existing
+ * entry for the same page if there is one and otherwise evicting an
+ * entry chosen by the replacement policy if the TLB is full. PRELOAD
+ * says it is loaded ahead of use (fault-around) rather than for a
+ * miss, and is counted apart so it doesn't inflate the miss counts.
+ *
+ * vm_tlb_flush invalidates the whole TLB of the current cpu.
+ *
+ * vm_tlb_activate makes AS the active address space on the current
+ * cpu, giving it an address space ID there if it has none. It does
+ * nothing if AS is already active.
+ *
+ * vm_tlb_flushas drops all of AS's translations on the other cpus,
+ * and on this one too if LOCAL is set. AS must not be running on any
+ * other cpu.
+ *
+ * vm_tlb_invalidate invalidates AS's entry for VADDR, if any, in the
+ * current cpu's TLB. vm_tlb_shootdown does it for the N pages in
+ * VADDRS on every cpu, and waits until they all have. It must be
+ * called with interrupts on and without AS's as_lock held.
+ *
+ * vm_tlb_setpolicy selects the replacement policy by name ("rr",
+ * "random", or "lru") and resets the fill and eviction counters;
+ * it returns EINVAL for an unknown name. vm_tlb_printstats prints
+ * the policy and the per-cpu counters.
+ *
+ * vm_tlb_forget stops the UTLB refill fast path from using AS's page
+ * table on any cpu; call it before destroying the page table.
+ * vm_tlb_setfastrefill turns the fast path on or off; it returns
+ * ENOSYS for on with hashed page tables, which it can't walk.
+ * vm_tlb_getfastrefill returns whether it is on.
+ */
+#define TLBPOLICY_RR		0
+#define TLBPOLICY_RANDOM	1
+#define TLBPOLICY_LRU		2
+
+struct addrspace;
+
+void vm_tlb_load(vaddr_t vaddr, uint32_t elo, bool preload);
+void vm_tlb_flush(void);
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_flushas(struct addrspace *as, bool local);
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_shootdown(struct addrspace *as, const vaddr_t *vaddrs,
+		      unsigned n);
+int vm_tlb_setpolicy(const char *name);
+void vm_tlb_printstats(void);
+void vm_tlb_forget(struct addrspace *as);
+bool vm_tlb_getfastrefill(void);
+int vm_tlb_setfastrefill(bool on);
+
 /*
  * TLB shootdown bits.
  *
@@ -123,10 +220,8 @@ int freeppages(paddr_t addr, unsigned long npages);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space of... */
+	vaddr_t ts_vaddr;		/* ...page to invalidate */
 };
 
 #define TLBSHOOTDOWN_MAX 16
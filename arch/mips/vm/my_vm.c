@@ -29,6 +29,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <cpu.h>
@@ -36,7 +38,20 @@
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <addrspace.h>
 #include <vm.h>
+#include <pt.h>
+#include <coremap.h>
+#include <vmstats.h>
+#include <swapfile.h>
+#include <pagecache.h>
+#include <pageout.h>
+#include <zeropool.h>
+#include <ksm.h>
+#include <zstore.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -54,57 +69,48 @@
  * it's cutting (there are many) and why, and more importantly, how.
  */
 
-#define DUMBVM_STACKPAGES 18
-#define SetBit(A, k) (A[k / 32] |= (1 << (k % 32)))
-#define ClearBit(A, k) (A[k / 32] &= ~(1 << (k % 32)))
-#define TestBit(A, k) (A[k / 32] & (1 << (k % 32)))
-#define SIZE_BITMAP 0xffffffff / (PAGE_SIZE * 32)
+/*
+ * The user stack starts out as one page below USERSTACK and grows
+ * down on demand (see as_growstack), up to vm_stackmaxpages pages.
+ * It never comes within VM_STACKGUARD pages of the top of the heap,
+ * and the heap never grows within that distance of the stack.
+ */
+#define VM_STACKINITPAGES 1
+#define VM_STACKGUARD 16
+
+static unsigned vm_stackmaxpages = VM_STACKMAXPAGES;
+
+/* Fault-around window, in pages. */
+static unsigned vm_faultaroundpages = VM_FAULTAROUND_DEFAULT;
 
 /*
  * Wrap ram_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
 
-static int *freeRamFrames = NULL;
-static unsigned long *allocSize = NULL;
-static int nRamFrames = 0;
-
-static int allocTableActive = 0;
+/*
+ * Serializes page-out. Also keeps the number of TLB shootdowns in
+ * flight to one per CPU.
+ */
+static struct lock *evict_lock;
 
-static int isTableActive()
-{
-	int active;
-	spinlock_acquire(&freemem_lock);
-	active = allocTableActive;
-	spinlock_release(&freemem_lock);
-	return active;
-}
+static struct region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+static int vm_writepage(struct region *rg, vaddr_t vaddr, paddr_t paddr);
+static int vm_slotout(paddr_t paddr, pte_t *slotpte);
 
 void vm_bootstrap(void)
 {
-	int i;
-	nRamFrames = ((int)ram_getsize()) / PAGE_SIZE;
-	freeRamFrames = kmalloc(sizeof(unsigned char) * (nRamFrames * 32));
-	// KASSERT(sizeof(freeRamFrames) == SIZE_BITMAP);
+	coremap_bootstrap();
 
-	if (freeRamFrames == NULL)
-		return;
-	allocSize = kmalloc(sizeof(unsigned long) * nRamFrames);
-	if (allocSize == NULL)
-	{
-		/* reset to disable this vm management */
-		freeRamFrames = NULL;
-		return;
-	}
-	for (i = 0; i < nRamFrames; i++)
+	evict_lock = lock_create("evict");
+	if (evict_lock == NULL)
 	{
-		ClearBit(freeRamFrames, i);
-		allocSize[i] = 0;
+		panic("vm_bootstrap: lock_create failed\n");
 	}
-	spinlock_acquire(&freemem_lock);
-	allocTableActive = 1;
-	spinlock_release(&freemem_lock);
+
+	zstore_bootstrap();
+	pageout_bootstrap();
+	ksm_bootstrap();
 }
 
 /*
@@ -127,27 +133,154 @@ void dumbvm_can_sleep(void)
 	}
 }
 
+/*
+ * Page-out.
+ *
+ * A page on its way out goes through three states in its owner's
+ * page table, each change made holding the owner's as_lock:
+ *
+ *    VALID    resident; the frame is marked busy in the coremap
+ *             by coremap_pickvictim.
+ *    TRANSIT  no longer mapped (TLBs shot down), being written.
+ *             Anyone who finds this waits for the frame to be
+ *             unbusied and looks again.
+ *    SWAPPED  on disk; the frame number field holds the swap slot.
+ *
+ * Private pages go to the compressed store if they fit, and to swap
+ * otherwise (see vm_slotout). Pages of shared file mappings go back
+ * to their file instead, if dirty, and end up as 0 so they are read
+ * in again when next used.
+ *
+ * The frame itself is then handed to whoever needed memory. Pages
+ * that are shared copy-on-write are never picked, since they have
+ * more than one page table entry to update.
+ *
+ * Called by the pageout daemon, and by getppages directly when the
+ * daemon has not kept up.
+ */
 paddr_t
-getppages(unsigned long npages)
+vm_evict(unsigned maxscan, unsigned *scanned)
 {
-	paddr_t addr;
+	struct addrspace *as;
+	struct region *rg;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte, slotpte = 0;
+	unsigned n;
+	bool tofile, dirty;
+	int result;
+
+	*scanned = 0;
+	if (lock_do_i_hold(evict_lock))
+	{
+		/* Swap I/O itself ran out of memory; don't recurse. */
+		return 0;
+	}
+
+	lock_acquire(evict_lock);
+
+	while (1)
+	{
+		paddr = coremap_pickvictim(maxscan - *scanned, &n, &as, &vaddr);
+		*scanned += n;
+		if (paddr == 0)
+		{
+			lock_release(evict_lock);
+			return 0;
+		}
+
+		spinlock_acquire(&as->as_lock);
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & (PTE_VALID | PTE_FRAME)) == (paddr | PTE_VALID));
+		if (coremap_getref(paddr) == 1)
+		{
+			break;
+		}
+		/* as_copy got there first and shared it; try another. */
+		spinlock_release(&as->as_lock);
+		coremap_unbusy(paddr);
+	}
+
+	rg = as_findregion(as, vaddr);
+	KASSERT(rg != NULL);
+	tofile = rg->rg_shared && rg->rg_vnode != NULL;
+	dirty = (*pte & PTE_WRITE) != 0;
+
+	*pte = (*pte & ~(pte_t)PTE_VALID) | PTE_TRANSIT;
+	spinlock_release(&as->as_lock);
 
-	/* try freed pages first */
-	addr = getfreeppages(npages);
-	if (addr == 0)
+	vm_tlb_shootdown(as, &vaddr, 1);
+
+	if (tofile)
+	{
+		result = dirty ? vm_writepage(rg, vaddr, paddr) : 0;
+	}
+	else
+	{
+		result = vm_slotout(paddr, &slotpte);
+	}
+
+	spinlock_acquire(&as->as_lock);
+	if (result)
+	{
+		/* Couldn't write it out; leave it where it was. */
+		*pte = (*pte & ~(pte_t)PTE_TRANSIT) | PTE_VALID;
+		spinlock_release(&as->as_lock);
+		coremap_unbusy(paddr);
+		lock_release(evict_lock);
+		return 0;
+	}
+	if (tofile)
+	{
+		*pte = 0;
+	}
+	else
 	{
-		/* call stealmem */
-		spinlock_acquire(&stealmem_lock);
-		addr = ram_stealmem(npages);
-		spinlock_release(&stealmem_lock);
+		*pte = slotpte | (*pte & (PTE_WRITE | PTE_COW));
 	}
-	if (addr != 0 && isTableActive())
+	spinlock_release(&as->as_lock);
+
+	coremap_setowner(paddr, NULL, 0);
+	coremap_unbusy(paddr);
+
+	lock_release(evict_lock);
+	return paddr;
+}
+
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+	unsigned scanned;
+
+	if (coremap_active())
 	{
-		spinlock_acquire(&freemem_lock);
-		allocSize[addr / PAGE_SIZE] = npages;
-		spinlock_release(&freemem_lock);
+		addr = coremap_alloc(npages);
+		if (addr == 0 && npages == 1)
+		{
+			/* Pre-zeroed frames are still frames. */
+			addr = zeropool_reclaim();
+		}
+		if (addr == 0 && npages == 1 && (swap_enabled() || zstore_enabled()))
+		{
+			/* The pageout daemon hasn't kept up; do it here. */
+			addr = vm_evict(2 * coremap_nframes(), &scanned);
+			vmstats_add(VMSTAT_PAGEOUT_SCANNED, scanned);
+			if (addr != 0)
+			{
+				vmstats_inc(VMSTAT_DIRECT_RECLAIMS);
+			}
+		}
+		pageout_check();
+		return addr;
 	}
 
+	/* too early for the coremap: call stealmem */
+	spinlock_acquire(&stealmem_lock);
+	addr = ram_stealmem(npages);
+	spinlock_release(&stealmem_lock);
+
 	return addr;
 }
 
@@ -169,362 +302,1669 @@ alloc_kpages(unsigned npages)
 
 void free_kpages(vaddr_t addr)
 {
-	if (isTableActive())
+	if (coremap_active())
 	{
-		paddr_t paddr = addr - MIPS_KSEG0;
-		long first = paddr / PAGE_SIZE;
-		KASSERT(allocSize != NULL);
-		KASSERT(nRamFrames > first);
-		freeppages(paddr, allocSize[first]);
+		coremap_free(KVADDR_TO_PADDR(addr), 0);
 	}
 }
 
-paddr_t
-getfreeppages(unsigned long npages)
+int
+freeppages(paddr_t addr, unsigned long npages)
 {
-	paddr_t addr;
-	long i, first, found, np = (long)npages;
-
-	if (!isTableActive())
+	if (!coremap_active())
 		return 0;
-	spinlock_acquire(&freemem_lock);
-	for (i = 0, first = found = -1; i < nRamFrames; i++)
+	coremap_free(addr, npages);
+	return 1;
+}
+
+void vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
+}
+
+void vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlb_invalidate(ts->ts_as, ts->ts_vaddr);
+}
+
+bool vm_idle(void)
+{
+	return zeropool_fill();
+}
+
+/*
+ * Return the region of AS containing VADDR, or NULL if VADDR is not
+ * part of the address space. The mmap list only changes with as_lock
+ * held, so other threads (page-out) hold it to look at the list; the
+ * owning process, which makes all the changes, needn't.
+ */
+static struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *regions[4] = {&as->as_code, &as->as_data, &as->as_heap,
+								 &as->as_stack};
+	struct region *rg;
+	unsigned i;
+
+	for (i = 0; i < 4; i++)
 	{
-		if (TestBit(freeRamFrames, i))
+		rg = regions[i];
+		if (vaddr >= rg->rg_vbase &&
+			vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE)
 		{
-			if (i == 0 || !TestBit(freeRamFrames, i - 1))
-				first = i; /* set first free in an interval */
-			if (i - first + 1 >= np)
-			{
-				found = first;
-				break;
-			}
+			return rg;
 		}
 	}
-
-	if (found >= 0)
+	for (rg = as->as_mmaps; rg != NULL; rg = rg->rg_next)
 	{
-		for (i = found; i < found + np; i++)
+		if (vaddr >= rg->rg_vbase &&
+			vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE)
 		{
-			ClearBit(freeRamFrames, i);
+			return rg;
 		}
-		allocSize[found] = np;
-		addr = (paddr_t)found * PAGE_SIZE;
-	}
-	else
-	{
-		addr = 0;
 	}
-
-	spinlock_release(&freemem_lock);
-
-	return addr;
+	return NULL;
 }
-int
-freeppages(paddr_t addr, unsigned long npages)
+
+/*
+ * Grow the stack of AS down to cover VADDR, if that is allowed, and
+ * return it; otherwise return NULL. The new pages get frames as they
+ * are touched, like any others.
+ */
+static struct region *
+as_growstack(struct addrspace *as, vaddr_t vaddr)
 {
-	long i, first, np = (long)npages;
+	struct region *stack = &as->as_stack;
+	vaddr_t top, floor;
 
-	if (!isTableActive())
-		return 0;
-	first = addr / PAGE_SIZE;
-	KASSERT(allocSize != NULL);
-	KASSERT(nRamFrames > first);
+	if (stack->rg_npages == 0 || vaddr >= stack->rg_vbase)
+	{
+		return NULL;
+	}
 
-	spinlock_acquire(&freemem_lock);
-	for (i = first; i < first + np; i++)
+	top = stack->rg_vbase + stack->rg_npages * PAGE_SIZE;
+	floor = 0;
+	if (top > vm_stackmaxpages * PAGE_SIZE)
+	{
+		floor = top - vm_stackmaxpages * PAGE_SIZE;
+	}
+	if (vaddr < floor ||
+		vaddr < as->as_heap.rg_vbase + (as->as_heap.rg_npages +
+										VM_STACKGUARD) * PAGE_SIZE)
+	{
+		return NULL;
+	}
+	/* The highest mapping, if the limit was raised after it was made. */
+	if (as->as_mmaps != NULL &&
+		vaddr < as->as_mmaps->rg_vbase + (as->as_mmaps->rg_npages +
+										  VM_STACKGUARD) * PAGE_SIZE)
 	{
-		SetBit(freeRamFrames, i);
+		return NULL;
 	}
-	spinlock_release(&freemem_lock);
 
-	return 1;
+	vmstats_add(VMSTAT_STACKGROWTH, (stack->rg_vbase - vaddr) / PAGE_SIZE);
+	stack->rg_npages += (stack->rg_vbase - vaddr) / PAGE_SIZE;
+	stack->rg_vbase = vaddr;
+	return stack;
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *ts)
+void vm_setstackmax(unsigned npages)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	vm_stackmaxpages = npages;
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress)
+unsigned vm_getstackmax(void)
 {
-	vaddr_t vbase_code, vtop_code, vbase_data, vtop_data, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
-	struct addrspace *as;
-	int spl;
+	return vm_stackmaxpages;
+}
 
-	faultaddress &= PAGE_FRAME;
+static void
+as_zero_region(paddr_t paddr, unsigned npages)
+{
+	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+}
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+/*
+ * Get a zero-filled frame: one the idle loop cleared in advance if
+ * there is one, otherwise a new one cleared now.
+ */
+static paddr_t
+vm_zeroedpage(void)
+{
+	paddr_t paddr;
 
-	switch (faulttype)
+	paddr = zeropool_get();
+	if (paddr == 0)
 	{
-	case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
-	case VM_FAULT_READ:
-	case VM_FAULT_WRITE:
-		break;
-	default:
-		return EINVAL;
+		paddr = getppages(1);
+		if (paddr != 0)
+		{
+			as_zero_region(paddr, 1);
+		}
 	}
+	return paddr;
+}
 
-	if (curproc == NULL)
-	{
-		/*
-		 * No process. This is probably a kernel fault early
-		 * in boot. Return EFAULT so as to panic instead of
-		 * getting into an infinite faulting loop.
-		 */
-		return EFAULT;
-	}
+/*
+ * Install a resident translation in the TLB. Called with the
+ * address space locked, so that a page-out can't unmap the page
+ * between here and its TLB shootdown.
+ */
+static void
+vm_maptlb(struct addrspace *as, vaddr_t vaddr, pte_t pte)
+{
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+	KASSERT(pte & PTE_VALID);
 
-	as = proc_getas();
-	if (as == NULL)
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", vaddr, pte & PTE_FRAME);
+	if ((pte & PTE_KERNEL) == 0)
 	{
-		/*
-		 * No address space set up. This is probably also a
-		 * kernel fault early in boot.
-		 */
-		return EFAULT;
+		coremap_touch(pte & PTE_FRAME);
 	}
+	vm_tlb_load(vaddr, PTE_TO_TLBLO(pte), false);
+}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase_code != 0);
-	KASSERT(as->as_pbase_code != 0);
-	KASSERT(as->as_npages_code != 0);
-	KASSERT(as->as_vbase_data != 0);
-	KASSERT(as->as_pbase_data != 0);
-	KASSERT(as->as_npages_data != 0);
-	KASSERT(as->as_pbase_stack != 0);
-	KASSERT((as->as_vbase_code & PAGE_FRAME) == as->as_vbase_code);
-	KASSERT((as->as_pbase_code & PAGE_FRAME) == as->as_pbase_code);
-	KASSERT((as->as_vbase_data & PAGE_FRAME) == as->as_vbase_data);
-	KASSERT((as->as_pbase_data & PAGE_FRAME) == as->as_pbase_data);
-	KASSERT((as->as_pbase_stack & PAGE_FRAME) == as->as_pbase_stack);
+/*
+ * Load the TLB with the other resident pages of RG in the fault-around
+ * window containing VADDR. They are not marked used in the coremap:
+ * nothing has touched them yet. Called with AS locked, like
+ * vm_maptlb.
+ */
+static void
+vm_faultaround(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	vaddr_t start, end, va;
+	pte_t *pte;
+	unsigned n;
 
-	vbase_code = as->as_vbase_code;
-	vtop_code = vbase_code + as->as_npages_code * PAGE_SIZE;
-	vbase_data = as->as_vbase_data;
-	vtop_data = vbase_data + as->as_npages_data * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
 
-	if (faultaddress >= vbase_code && faultaddress < vtop_code)
+	if (vm_faultaroundpages <= 1)
 	{
-		paddr = (faultaddress - vbase_code) + as->as_pbase_code;
-	}
-	else if (faultaddress >= vbase_data && faultaddress < vtop_data)
-	{
-		paddr = (faultaddress - vbase_data) + as->as_pbase_data;
+		return;
 	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop)
+
+	start = vaddr - ((vaddr / PAGE_SIZE) % vm_faultaroundpages) * PAGE_SIZE;
+	end = start + vm_faultaroundpages * PAGE_SIZE;
+	if (start < rg->rg_vbase)
 	{
-		paddr = (faultaddress - stackbase) + as->as_pbase_stack;
+		start = rg->rg_vbase;
 	}
-	else
+	if (end > rg->rg_vbase + rg->rg_npages * PAGE_SIZE || end < start)
 	{
-		return EFAULT;
+		end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
 	}
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i = 0; i < NUM_TLB; i++)
+	n = 0;
+	for (va = start; va < end; va += PAGE_SIZE)
 	{
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID)
+		if (va == vaddr)
 		{
 			continue;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || (*pte & PTE_VALID) == 0)
+		{
+			continue;
+		}
+		vm_tlb_load(va, PTE_TO_TLBLO(*pte), true);
+		n++;
 	}
-
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
-}
-
-struct addrspace *as_create(void)
-{
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
-	if (as == NULL)
+	if (n > 0)
 	{
-		return NULL;
+		vmstats_add(VMSTAT_FAULTAROUND, n);
 	}
-
-	as->as_vbase_code = 0;
-	as->as_pbase_code = 0;
-	as->as_npages_code = 0;
-	as->as_vbase_data = 0;
-	as->as_pbase_data = 0;
-	as->as_npages_data = 0;
-	as->as_pbase_stack = 0;
-
-	return as;
 }
 
-void as_destroy(struct addrspace *as)
-{
-	dumbvm_can_sleep();
-	kfree(as);
-}
-
-void as_activate(void)
+int vm_setfaultaround(unsigned npages)
 {
-	int i, spl;
-	struct addrspace *as;
-
-	as = proc_getas();
-	if (as == NULL)
-	{
-		return;
-	}
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i = 0; i < NUM_TLB; i++)
+	if (npages == 0 || npages > VM_FAULTAROUND_MAX)
 	{
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		return EINVAL;
 	}
-
-	splx(spl);
+	vm_faultaroundpages = npages;
+	return 0;
 }
 
-void as_deactivate(void)
+unsigned vm_getfaultaround(void)
 {
-	/* nothing */
+	return vm_faultaroundpages;
 }
+
 /*
- * Set up a segment at virtual address VADDR of size MEMSIZE. The
- * segment in memory extends from VADDR up to (but not including)
- * VADDR+MEMSIZE.
+ * Write to a copy-on-write page, whose entry was OLDPTE when the
+ * caller looked at it with the address space locked. If nobody else
+ * maps the frame any more it simply becomes writable again;
+ * otherwise this address space gets its own copy of the page.
  *
- * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * Called with AS locked; returns with it unlocked.
  */
-int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-					 int readable, int writeable, int executable)
+static int
+vm_cowfault(struct addrspace *as, vaddr_t vaddr, pte_t *pte, pte_t oldpte)
 {
-	size_t npages;
-
-	dumbvm_can_sleep();
+	paddr_t oldpaddr, newpaddr;
 
-	/* Align the region. First, the base... */
-	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
+	KASSERT(oldpte & PTE_VALID);
+	KASSERT(oldpte & PTE_COW);
 
-	/* ...and now the length. */
-	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	vmstats_inc(VMSTAT_COW_FAULTS);
 
-	npages = sz / PAGE_SIZE;
+	oldpaddr = oldpte & PTE_FRAME;
+	if (coremap_getref(oldpaddr) == 1)
+	{
+		*pte = (oldpte & ~(pte_t)PTE_COW) | PTE_WRITE;
+		coremap_setowner(oldpaddr, as, vaddr);
+		vm_maptlb(as, vaddr, *pte);
+		spinlock_release(&as->as_lock);
+		return 0;
+	}
+	spinlock_release(&as->as_lock);
 
-	/* We don't use these - all pages are read-write */
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+	/*
+	 * The old frame can't go away under us: we still hold our
+	 * reference, and a shared frame is never paged out.
+	 */
+	newpaddr = getppages(1);
+	if (newpaddr == 0)
+	{
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpaddr),
+			(const void *)PADDR_TO_KVADDR(oldpaddr), PAGE_SIZE);
 
-	if (as->as_vbase_code == 0)
+	spinlock_acquire(&as->as_lock);
+	if (*pte != oldpte)
 	{
-		as->as_vbase_code = vaddr;
-		as->as_npages_code = npages;
+		/* Changed while we were copying; let the caller retry. */
+		spinlock_release(&as->as_lock);
+		coremap_decref(newpaddr);
 		return 0;
 	}
-
-	if (as->as_vbase_data == 0)
+	if (!coremap_clearowner(oldpaddr, as, vaddr))
 	{
-		as->as_vbase_data = vaddr;
-		as->as_npages_data = npages;
+		/* Being merged or paged out; retry once it's done. */
+		spinlock_release(&as->as_lock);
+		coremap_decref(newpaddr);
+		coremap_waitbusy(oldpaddr);
 		return 0;
 	}
+	*pte = newpaddr | (oldpte & ~(pte_t)(PTE_FRAME | PTE_COW)) | PTE_WRITE;
+	coremap_setowner(newpaddr, as, vaddr);
+	vm_maptlb(as, vaddr, *pte);
+	spinlock_release(&as->as_lock);
 
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return ENOSYS;
-}
+	/* Other cpus may still map the old frame from earlier runs. */
+	vm_tlb_flushas(as, false);
 
-int as_define_kernel_region(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, size_t npages)
-{
-	as->as_pbase_code = paddr;
-	as->as_vbase_code = vaddr;
-	as->as_npages_code = npages;
+	coremap_decref(oldpaddr);
+	vmstats_inc(VMSTAT_COW_COPIES);
 	return 0;
 }
 
-static void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
-//TODO to modify to insert bitmap
+/*
+ * Page merging (see ksm.h). The merger keeps the frame busy all the
+ * while, so that its owner can neither page it out nor unmap it, and
+ * only looks at the page table entry with the owner's as_lock held.
+ *
+ * A page is write-protected before its contents are compared: if it
+ * was writable it becomes copy-on-write, so that a write now faults
+ * and, the page being unshared, simply makes it writable again (see
+ * vm_cowfault). Later steps check under the lock that this hasn't
+ * happened. Pages of shared file mappings, whose PTE_WRITE means
+ * dirty, are never merged.
+ */
+
+/*
+ * Returns true if the entry at PTE still maps PADDR write-protected.
+ */
+static bool
+vm_ksmunchanged(pte_t *pte, paddr_t paddr)
+{
+	return pte != NULL &&
+		   (*pte & (PTE_VALID | PTE_WRITE | PTE_FRAME)) == (paddr | PTE_VALID);
+}
+
+/*
+ * Write-protect the page at VADDR in AS, held in the busy frame at
+ * PADDR. Returns false if it can't be merged.
+ */
+bool
+vm_ksmprotect(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct region *rg;
+	pte_t *pte;
+	bool changed = false;
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	rg = as_findregion(as, vaddr);
+	if (pte == NULL || rg == NULL || (rg->rg_shared && rg->rg_vnode != NULL) ||
+		(*pte & (PTE_VALID | PTE_FRAME)) != (paddr | PTE_VALID) ||
+		(*pte & (PTE_KERNEL | PTE_CACHED | PTE_TRANSIT)))
+	{
+		spinlock_release(&as->as_lock);
+		return false;
+	}
+	if (*pte & PTE_WRITE)
+	{
+		*pte = (*pte & ~(pte_t)PTE_WRITE) | PTE_COW;
+		changed = true;
+	}
+	spinlock_release(&as->as_lock);
+
+	if (changed)
+	{
+		vm_tlb_shootdown(as, &vaddr, 1);
+	}
+	return true;
+}
+
+/*
+ * Take an extra reference to the write-protected page at VADDR in AS,
+ * held in the busy frame at PADDR, making it shared: from now on its
+ * contents can't change. Returns false if it was written meanwhile.
+ */
+bool
+vm_ksmshare(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	bool ok;
+
+	spinlock_acquire(&as->as_lock);
+	ok = vm_ksmunchanged(pt_lookup(as->as_pt, vaddr, false), paddr);
+	if (ok)
+	{
+		coremap_incref(paddr, NULL, 0);
+	}
+	spinlock_release(&as->as_lock);
+
+	return ok;
+}
+
+/*
+ * Map the write-protected page at VADDR in AS, held in the busy frame
+ * at PADDR, to the shared frame NEWPADDR instead, which must have the
+ * same contents. PADDR loses its owner but keeps its reference, for
+ * the caller to drop once it has unbusied it. Returns false if the
+ * page was written meanwhile.
+ */
+bool
+vm_ksmreplace(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+			  paddr_t newpaddr)
+{
+	pte_t *pte;
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (!vm_ksmunchanged(pte, paddr))
+	{
+		spinlock_release(&as->as_lock);
+		return false;
+	}
+	coremap_incref(newpaddr, as, vaddr);
+	*pte = newpaddr | (*pte & ~(pte_t)PTE_FRAME);
+	spinlock_release(&as->as_lock);
+
+	vm_tlb_shootdown(as, &vaddr, 1);
+	coremap_setowner(paddr, NULL, 0);
+	return true;
+}
+
+/*
+ * Offset in RG's file of the page at VADDR. Negative if the file data
+ * starts part way into the region's first page.
+ */
+static off_t
+as_fileoffset(struct region *rg, vaddr_t vaddr)
+{
+	return rg->rg_offset + ((off_t)vaddr - (off_t)rg->rg_fileva);
+}
+
+/*
+ * Read the part of the page at VADDR that comes from RG's file into
+ * the (already zeroed) frame at PADDR.
+ */
+static int
+vm_readpage(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	start = vaddr > rg->rg_fileva ? vaddr : rg->rg_fileva;
+	end = rg->rg_fileva + rg->rg_filesize;
+	if (end > vaddr + PAGE_SIZE)
+	{
+		end = vaddr + PAGE_SIZE;
+	}
+	if (start >= end)
+	{
+		/* Entirely past the end of the file data (bss). */
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+			  end - start, rg->rg_offset + (start - rg->rg_fileva), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result)
+	{
+		return result;
+	}
+	if (ku.uio_resid != 0)
+	{
+		kprintf("vm: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	vmstats_inc(VMSTAT_FILEREADS);
+	return 0;
+}
+
+/*
+ * Write the page at VADDR of shared file region RG, in the frame at
+ * PADDR, back to the file. Only the part that came from the file is
+ * written, so the file never grows.
+ */
+static int
+vm_writepage(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t end;
+	int result;
+
+	end = rg->rg_fileva + rg->rg_filesize;
+	if (end > vaddr + PAGE_SIZE)
+	{
+		end = vaddr + PAGE_SIZE;
+	}
+	if (vaddr >= end)
+	{
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), end - vaddr,
+			  as_fileoffset(rg, vaddr), UIO_WRITE);
+	result = VOP_WRITE(rg->rg_vnode, &ku);
+	if (result)
+	{
+		return result;
+	}
+
+	vmstats_inc(VMSTAT_FILEWRITES);
+	return 0;
+}
+
+/*
+ * Find or read in the frame for a page of a read-only file region in
+ * the page cache, so that every process running the same program
+ * maps the same copy.
+ */
+static int
+vm_cachedpage(struct region *rg, vaddr_t vaddr, paddr_t *ret)
+{
+	paddr_t paddr;
+	off_t offset;
+	int result;
+
+	offset = as_fileoffset(rg, vaddr);
+	paddr = pagecache_lookup(rg->rg_vnode, offset);
+	if (paddr != 0)
+	{
+		*ret = paddr;
+		return 0;
+	}
+
+	paddr = vm_zeroedpage();
+	if (paddr == 0)
+	{
+		return ENOMEM;
+	}
+	result = vm_readpage(rg, vaddr, paddr);
+	if (result)
+	{
+		coremap_decref(paddr);
+		return result;
+	}
+
+	paddr = pagecache_insert(rg->rg_vnode, offset, paddr);
+	if (paddr == 0)
+	{
+		return ENOMEM;
+	}
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * Backing store for private pages. A page that is paged out goes to
+ * the compressed store if it compresses well enough and there is
+ * room, and to swap otherwise. Either way it is left with its slot
+ * in the page table entry: vm_slotout returns the slot part of the
+ * new entry in SLOTPTE, and vm_slotin and vm_slotfree take the entry.
+ */
+static int
+vm_slotout(paddr_t paddr, pte_t *slotpte)
+{
+	unsigned slot;
+	int result;
+
+	if (zstore_out(paddr, &slot) == 0)
+	{
+		*slotpte = ((pte_t)slot << PTE_SLOTSHIFT) | PTE_ZSTORED | PTE_SWAPPED;
+		return 0;
+	}
+
+	result = swap_alloc(&slot);
+	if (result)
+	{
+		return result;
+	}
+	result = swap_out(paddr, slot);
+	if (result)
+	{
+		kprintf("vm: swap_out: %s\n", strerror(result));
+		swap_free(slot);
+		return result;
+	}
+	*slotpte = ((pte_t)slot << PTE_SLOTSHIFT) | PTE_SWAPPED;
+	return 0;
+}
+
+static int
+vm_slotin(paddr_t paddr, pte_t pte)
+{
+	KASSERT(pte & PTE_SWAPPED);
+
+	if (pte & PTE_ZSTORED)
+	{
+		return zstore_in(paddr, pte >> PTE_SLOTSHIFT);
+	}
+	return swap_in(paddr, pte >> PTE_SLOTSHIFT);
+}
+
+static void
+vm_slotfree(pte_t pte)
+{
+	KASSERT(pte & PTE_SWAPPED);
+
+	if (pte & PTE_ZSTORED)
+	{
+		zstore_free(pte >> PTE_SLOTSHIFT);
+	}
+	else
+	{
+		swap_free(pte >> PTE_SLOTSHIFT);
+	}
+}
+
+/*
+ * Give a non-resident page a frame: one read back in if it has
+ * been paged out, the shared cached copy if it is in a read-only
+ * private file region, otherwise a zeroed one, with its share of RG's
+ * file read into it if RG is loaded from a file. OLDPTE is the entry
+ * as last seen with the address space locked.
+ */
+static int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		  pte_t *pte, pte_t oldpte)
+{
+	paddr_t paddr;
+	pte_t newpte;
+	int result;
+
+	if (oldpte == 0 && rg->rg_vnode != NULL && rg->rg_readonly &&
+		!rg->rg_shared)
+	{
+		result = vm_cachedpage(rg, vaddr, &paddr);
+		if (result)
+		{
+			return result;
+		}
+		newpte = paddr | PTE_CACHED | PTE_VALID;
+
+		spinlock_acquire(&as->as_lock);
+		if (*pte != oldpte)
+		{
+			spinlock_release(&as->as_lock);
+			pagecache_release(rg->rg_vnode, as_fileoffset(rg, vaddr),
+							  paddr);
+			return 0;
+		}
+		*pte = newpte;
+		vm_maptlb(as, vaddr, newpte);
+		spinlock_release(&as->as_lock);
+		return 0;
+	}
+
+	paddr = (oldpte & PTE_SWAPPED) ? getppages(1) : vm_zeroedpage();
+	if (paddr == 0)
+	{
+		return ENOMEM;
+	}
+
+	if (oldpte & PTE_SWAPPED)
+	{
+		result = vm_slotin(paddr, oldpte);
+		if (result)
+		{
+			coremap_decref(paddr);
+			return result;
+		}
+		/* The page is private now, whether or not it was COW. */
+		newpte = paddr | PTE_VALID;
+		if (oldpte & (PTE_WRITE | PTE_COW))
+		{
+			newpte |= PTE_WRITE;
+		}
+	}
+	else
+	{
+		KASSERT(oldpte == 0);
+		if (rg->rg_vnode != NULL)
+		{
+			result = vm_readpage(rg, vaddr, paddr);
+			if (result)
+			{
+				coremap_decref(paddr);
+				return result;
+			}
+		}
+		newpte = paddr | PTE_VALID;
+		if (!rg->rg_readonly && !(rg->rg_shared && rg->rg_vnode != NULL))
+		{
+			/* (Shared file pages become writable when dirtied.) */
+			newpte |= PTE_WRITE;
+		}
+	}
+
+	spinlock_acquire(&as->as_lock);
+	if (*pte != oldpte)
+	{
+		/* Someone else paged it in; use theirs. */
+		spinlock_release(&as->as_lock);
+		coremap_decref(paddr);
+		return 0;
+	}
+	*pte = newpte;
+	coremap_setowner(paddr, as, vaddr);
+	vm_maptlb(as, vaddr, newpte);
+	spinlock_release(&as->as_lock);
+
+	if (oldpte & PTE_SWAPPED)
+	{
+		vm_slotfree(oldpte);
+	}
+	else
+	{
+		vmstats_inc(VMSTAT_ZEROFILLS);
+	}
+	return 0;
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	pte_t *pte, oldpte;
+	struct addrspace *as;
+	struct region *rg;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype)
+	{
+	case VM_FAULT_READONLY:
+	case VM_FAULT_READ:
+	case VM_FAULT_WRITE:
+		break;
+	default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL)
+	{
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL)
+	{
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	/* Assert that the address space has been set up properly. */
+	KASSERT(as->as_pt != NULL);
+
+	vmstats_inc(VMSTAT_FAULTS);
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL)
+	{
+		rg = as_growstack(as, faultaddress);
+	}
+	if (rg == NULL)
+	{
+		return EFAULT;
+	}
+
+	/* Allocate the page table page now, while we may still sleep. */
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL)
+	{
+		return ENOMEM;
+	}
+
+	while (1)
+	{
+		spinlock_acquire(&as->as_lock);
+		oldpte = *pte;
+
+		if (oldpte & PTE_TRANSIT)
+		{
+			/* Being paged out; wait for it to finish. */
+			spinlock_release(&as->as_lock);
+			coremap_waitbusy(oldpte & PTE_FRAME);
+			continue;
+		}
+
+		if ((oldpte & PTE_VALID) == 0)
+		{
+			spinlock_release(&as->as_lock);
+			if (faulttype == VM_FAULT_READONLY)
+			{
+				/*
+				 * A store hit a read-only entry (e.g. a clean
+				 * shared file page) that was paged out before
+				 * we got the lock. Bring it back in and treat
+				 * it as the write miss it now is.
+				 */
+				faulttype = VM_FAULT_WRITE;
+			}
+			result = vm_pagein(as, rg, faultaddress, pte, oldpte);
+		}
+		else if (faulttype != VM_FAULT_READ && (oldpte & PTE_COW))
+		{
+			/*
+			 * Either a write hit the read-only TLB entry of a
+			 * shared page, or a write missed the TLB altogether;
+			 * break the sharing now rather than fault twice.
+			 */
+			result = vm_cowfault(as, faultaddress, pte, oldpte);
+		}
+		else if (faulttype != VM_FAULT_READ && (oldpte & PTE_WRITE) == 0 &&
+				 rg->rg_shared && rg->rg_vnode != NULL && !rg->rg_readonly)
+		{
+			/* First write to a clean shared file page: now dirty. */
+			*pte = oldpte | PTE_WRITE;
+			vm_maptlb(as, faultaddress, *pte);
+			spinlock_release(&as->as_lock);
+			return 0;
+		}
+		else if (faulttype == VM_FAULT_READONLY)
+		{
+			/* A real read-only page. */
+			spinlock_release(&as->as_lock);
+			return EFAULT;
+		}
+		else
+		{
+			vm_maptlb(as, faultaddress, oldpte);
+			vm_faultaround(as, rg, faultaddress);
+			spinlock_release(&as->as_lock);
+			return 0;
+		}
+
+		if (result)
+		{
+			return result;
+		}
+		/* Loop around to check that it really is mapped now. */
+	}
+}
+
+static void
+as_init_region(struct region *rg)
+{
+	rg->rg_vbase = 0;
+	rg->rg_npages = 0;
+	rg->rg_readonly = false;
+	rg->rg_shared = false;
+	rg->rg_vnode = NULL;
+	rg->rg_offset = 0;
+	rg->rg_fileva = 0;
+	rg->rg_filesize = 0;
+	rg->rg_next = NULL;
+}
+
+struct addrspace *as_create(void)
+{
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL)
+	{
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL)
+	{
+		kfree(as);
+		return NULL;
+	}
+	spinlock_init(&as->as_lock);
+	bzero(as->as_asid, sizeof(as->as_asid));
+
+	as_init_region(&as->as_code);
+	as_init_region(&as->as_data);
+	as_init_region(&as->as_heap);
+	as_init_region(&as->as_stack);
+	as->as_mmaps = NULL;
+	as->as_break = 0;
+
+	return as;
+}
+
+/*
+ * Drop the frames in a batch of pages as_unmap has just unmapped,
+ * once no TLB can still be using them, writing dirty shared file
+ * pages back first.
+ */
+static void
+as_unmap_flush(struct addrspace *as, struct region *rg, vaddr_t *vaddrs,
+			   pte_t *ptes, unsigned n, bool shootdown)
+{
+	unsigned i;
+	int result;
+
+	if (shootdown && n > 0)
+	{
+		vm_tlb_shootdown(as, vaddrs, n);
+	}
+	for (i = 0; i < n; i++)
+	{
+		if ((ptes[i] & PTE_WRITE) && rg->rg_shared && rg->rg_vnode != NULL)
+		{
+			result = vm_writepage(rg, vaddrs[i], ptes[i] & PTE_FRAME);
+			if (result)
+			{
+				kprintf("vm: write-back: %s\n", strerror(result));
+			}
+		}
+		if (ptes[i] & PTE_CACHED)
+		{
+			pagecache_release(rg->rg_vnode, as_fileoffset(rg, vaddrs[i]),
+							  ptes[i] & PTE_FRAME);
+		}
+		else
+		{
+			coremap_decref(ptes[i] & PTE_FRAME);
+		}
+	}
+}
+
+/*
+ * Unmap NPAGES pages of region RG starting at VADDR, releasing the
+ * frames and swap slots behind them. Frames are released in batches
+ * of up to TLBSHOOTDOWN_MAX pages, after one TLB shootdown for the
+ * whole batch if SHOOTDOWN is set (it needn't be for an address
+ * space that is being destroyed and so can't be running).
+ */
+static void
+as_unmap(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+		 size_t npages, bool shootdown)
+{
+	vaddr_t vaddrs[TLBSHOOTDOWN_MAX];
+	pte_t ptes[TLBSHOOTDOWN_MAX];
+	unsigned n;
+	pte_t *pte, oldpte;
+	size_t i;
+
+	n = 0;
+	for (i = 0; i < npages; i++, vaddr += PAGE_SIZE)
+	{
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte == NULL)
+		{
+			continue;
+		}
+
+		spinlock_acquire(&as->as_lock);
+		oldpte = *pte;
+		if (oldpte & PTE_TRANSIT)
+		{
+			spinlock_release(&as->as_lock);
+			coremap_waitbusy(oldpte & PTE_FRAME);
+			i--;
+			vaddr -= PAGE_SIZE;
+			continue;
+		}
+		if ((oldpte & PTE_VALID) && (oldpte & PTE_KERNEL) == 0 &&
+			!coremap_clearowner(oldpte & PTE_FRAME, as, vaddr))
+		{
+			/* Picked for page-out; wait until it's gone. */
+			spinlock_release(&as->as_lock);
+			coremap_waitbusy(oldpte & PTE_FRAME);
+			i--;
+			vaddr -= PAGE_SIZE;
+			continue;
+		}
+		*pte = 0;
+		spinlock_release(&as->as_lock);
+
+		if ((oldpte & PTE_VALID) && (oldpte & PTE_KERNEL) == 0)
+		{
+			vaddrs[n] = vaddr;
+			ptes[n] = oldpte;
+			if (++n == TLBSHOOTDOWN_MAX)
+			{
+				as_unmap_flush(as, rg, vaddrs, ptes, n, shootdown);
+				n = 0;
+			}
+		}
+		else if (oldpte & PTE_SWAPPED)
+		{
+			vm_slotfree(oldpte);
+		}
+	}
+	as_unmap_flush(as, rg, vaddrs, ptes, n, shootdown);
+}
+
+/*
+ * Release the frames and swap slots backing the pages of a region.
+ */
+static void
+as_free_region(struct addrspace *as, struct region *rg)
+{
+	as_unmap(as, rg, rg->rg_vbase, rg->rg_npages, false);
+
+	if (rg->rg_vnode != NULL)
+	{
+		VOP_DECREF(rg->rg_vnode);
+		rg->rg_vnode = NULL;
+	}
+}
+
+void as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+
+	dumbvm_can_sleep();
+
+	as_free_region(as, &as->as_code);
+	as_free_region(as, &as->as_data);
+	as_free_region(as, &as->as_heap);
+	as_free_region(as, &as->as_stack);
+	while ((rg = as->as_mmaps) != NULL)
+	{
+		/* Empty it first, so page-out can't be looking for it. */
+		as_free_region(as, rg);
+		spinlock_acquire(&as->as_lock);
+		as->as_mmaps = rg->rg_next;
+		spinlock_release(&as->as_lock);
+		kfree(rg);
+	}
+	vm_tlb_forget(as);
+	pt_destroy(as->as_pt);
+	spinlock_cleanup(&as->as_lock);
+	kfree(as);
+}
+
+void as_activate(void)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL)
+	{
+		/*
+		 * Kernel thread: leave the last address space's ASID
+		 * loaded, so its translations are still there if it is
+		 * what runs next.
+		 */
+		return;
+	}
+
+	vm_tlb_activate(as);
+}
+
+void as_deactivate(void)
+{
+	/*
+	 * Nothing to do: a destroyed address space's ASIDs are never
+	 * handed out again before the cpu's next ASID rollover, which
+	 * flushes the TLB, so its leftover translations can't match.
+	 */
+}
+/*
+ * Set up a segment at virtual address VADDR of size MEMSIZE. The
+ * segment in memory extends from VADDR up to (but not including)
+ * VADDR+MEMSIZE.
+ *
+ * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
+ * write, or execute permission should be set on the segment. At the
+ * moment, these are ignored. When you write the VM system, you may
+ * want to implement them.
+ */
+int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+					 int readable, int writeable, int executable)
+{
+	size_t npages;
+
+	dumbvm_can_sleep();
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	npages = sz / PAGE_SIZE;
+
+	/* Keep user regions out of kernel space (and from wrapping). */
+	if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr)
+	{
+		return EFAULT;
+	}
+
+	/*
+	 * Only read-only file regions (program text) are enforced,
+	 * since their pages are shared through the page cache. All
+	 * other pages are read-write.
+	 */
+	(void)readable;
+	(void)executable;
+
+	/* The heap starts after the last region loaded. */
+	KASSERT(as->as_heap.rg_npages == 0);
+	if (vaddr + sz > as->as_heap.rg_vbase)
+	{
+		as->as_heap.rg_vbase = vaddr + sz;
+		as->as_break = vaddr + sz;
+	}
+
+	if (as->as_code.rg_vbase == 0)
+	{
+		as->as_code.rg_vbase = vaddr;
+		as->as_code.rg_npages = npages;
+		as->as_code.rg_readonly = !writeable;
+		return 0;
+	}
+
+	if (as->as_data.rg_vbase == 0)
+	{
+		as->as_data.rg_vbase = vaddr;
+		as->as_data.rg_npages = npages;
+		as->as_data.rg_readonly = !writeable;
+		return 0;
+	}
+
+	/*
+	 * Support for more than two regions is not available.
+	 */
+	kprintf("dumbvm: Warning: too many regions\n");
+	return ENOSYS;
+}
+
+/*
+ * Record that the region containing VADDR gets FILESIZE bytes of V
+ * from OFFSET onwards, starting at VADDR. vm_readpage reads them in
+ * a page at a time as the pages are touched.
+ */
+int as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+				   off_t offset, size_t filesize)
+{
+	struct region *rg;
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_vnode != NULL)
+	{
+		return EINVAL;
+	}
+	if (filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE - vaddr)
+	{
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_offset = offset;
+	rg->rg_fileva = vaddr;
+	rg->rg_filesize = filesize;
+	return 0;
+}
+
+/*
+ * Map NPAGES of already-allocated physical memory starting at PADDR
+ * as the code region. The frames stay owned by the caller, so they
+ * are entered with PTE_KERNEL and never freed by as_destroy.
+ */
+int as_define_kernel_region(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, size_t npages)
+{
+	pte_t *pte;
+	size_t i;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	as->as_code.rg_vbase = vaddr;
+	as->as_code.rg_npages = npages;
+
+	for (i = 0; i < npages; i++)
+	{
+		pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE, true);
+		if (pte == NULL)
+		{
+			return ENOMEM;
+		}
+		*pte = (paddr + i * PAGE_SIZE) | PTE_KERNEL | PTE_WRITE | PTE_VALID;
+	}
+	return 0;
+}
+
+/*
+ * Nothing is allocated or read up front any more: every page of the
+ * code, data and stack regions is given a frame by vm_fault the first
+ * time it is touched, and load_elf just records where the segments
+ * are in the file (as_define_file).
+ */
 int as_prepare_load(struct addrspace *as)
 {
-	KASSERT(as->as_pbase_code == 0);
-	KASSERT(as->as_pbase_data == 0);
-	KASSERT(as->as_pbase_stack == 0);
+	dumbvm_can_sleep();
+	(void)as;
+	return 0;
+}
+
+int as_complete_load(struct addrspace *as)
+{
+	dumbvm_can_sleep();
+	(void)as;
+	return 0;
+}
+
+int as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	KASSERT(as->as_stack.rg_npages == 0);
+
+	as->as_stack.rg_vbase = USERSTACK - VM_STACKINITPAGES * PAGE_SIZE;
+	as->as_stack.rg_npages = VM_STACKINITPAGES;
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+/*
+ * Move the break by AMOUNT bytes, returning the old break in RET.
+ * Growing just makes the heap region bigger: the pages get frames
+ * when they are first touched. Shrinking unmaps the pages wholly
+ * above the new break and frees their frames.
+ */
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *ret)
+{
+	vaddr_t oldbreak, newbreak, limit, oldtop, newtop;
+	struct region *heap = &as->as_heap;
+	struct region *mm;
+
+	dumbvm_can_sleep();
+
+	oldbreak = as->as_break;
+	newbreak = oldbreak + amount;
+	if (amount < 0 ? newbreak > oldbreak : newbreak < oldbreak)
+	{
+		/* Wrapped around. */
+		return amount < 0 ? EINVAL : ENOMEM;
+	}
+	if (newbreak < heap->rg_vbase)
+	{
+		return EINVAL;
+	}
+
+	limit = USERSPACETOP;
+	if (as->as_stack.rg_npages > 0)
+	{
+		limit = as->as_stack.rg_vbase - VM_STACKGUARD * PAGE_SIZE;
+	}
+	for (mm = as->as_mmaps; mm != NULL; mm = mm->rg_next)
+	{
+		if (mm->rg_vbase - VM_STACKGUARD * PAGE_SIZE < limit)
+		{
+			limit = mm->rg_vbase - VM_STACKGUARD * PAGE_SIZE;
+		}
+	}
+	if (newbreak > limit)
+	{
+		return ENOMEM;
+	}
+
+	oldtop = heap->rg_vbase + heap->rg_npages * PAGE_SIZE;
+	newtop = (newbreak + PAGE_SIZE - 1) & PAGE_FRAME;
+	if (newtop < oldtop)
+	{
+		as_unmap(as, heap, newtop, (oldtop - newtop) / PAGE_SIZE, true);
+	}
+	heap->rg_npages = (newtop - heap->rg_vbase) / PAGE_SIZE;
+	as->as_break = newbreak;
+
+	*ret = oldbreak;
+	return 0;
+}
+
+/*
+ * Write back the dirty pages among NPAGES pages of shared file
+ * region RG starting at VADDR. Each page is made clean (read-only)
+ * and pinned before its frame is written, so that a write during the
+ * I/O dirties it again and page-out can't take the frame away
+ * meanwhile.
+ */
+static int
+as_syncpages(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+			 size_t npages)
+{
+	pte_t *pte, oldpte;
+	paddr_t paddr;
+	size_t i;
+	int result;
+
+	KASSERT(rg->rg_shared && rg->rg_vnode != NULL);
+
+	for (i = 0; i < npages; i++, vaddr += PAGE_SIZE)
+	{
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte == NULL)
+		{
+			continue;
+		}
+
+		spinlock_acquire(&as->as_lock);
+		oldpte = *pte;
+		paddr = oldpte & PTE_FRAME;
+		if (oldpte & PTE_TRANSIT)
+		{
+			/* Being written out by page-out; wait for it. */
+			spinlock_release(&as->as_lock);
+			coremap_waitbusy(paddr);
+			i--;
+			vaddr -= PAGE_SIZE;
+			continue;
+		}
+		if ((oldpte & (PTE_VALID | PTE_WRITE)) != (PTE_VALID | PTE_WRITE))
+		{
+			/* Clean or not resident. */
+			spinlock_release(&as->as_lock);
+			continue;
+		}
+		if (!coremap_pin(paddr))
+		{
+			spinlock_release(&as->as_lock);
+			coremap_waitbusy(paddr);
+			i--;
+			vaddr -= PAGE_SIZE;
+			continue;
+		}
+		*pte = oldpte & ~(pte_t)PTE_WRITE;
+		spinlock_release(&as->as_lock);
+
+		vm_tlb_shootdown(as, &vaddr, 1);
+		result = vm_writepage(rg, vaddr, paddr);
+		if (result)
+		{
+			/* Still dirty. */
+			spinlock_acquire(&as->as_lock);
+			*pte |= PTE_WRITE;
+			spinlock_release(&as->as_lock);
+		}
+		coremap_unpin(paddr);
+		if (result)
+		{
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Map LEN bytes, anonymous or of file V, in the first gap big enough
+ * working down from just below the stack's maximum extent. Nothing
+ * is read or allocated yet: pages are filled by vm_fault as they are
+ * touched, from the file if there is one (and zero past its end).
+ */
+int as_mmap(struct addrspace *as, size_t len, int prot, int flags,
+			struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct region *rg, *mm, **prevp;
+	struct stat st;
+	vaddr_t top, floor;
+	size_t size;
+	int result;
 
 	dumbvm_can_sleep();
 
-	as->as_pbase_code = getppages(as->as_npages_code);
-	if (as->as_pbase_code == 0)
+	if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0)
+	{
+		return EINVAL;
+	}
+	if ((flags & (MAP_SHARED | MAP_PRIVATE)) != MAP_SHARED &&
+		(flags & (MAP_SHARED | MAP_PRIVATE)) != MAP_PRIVATE)
+	{
+		return EINVAL;
+	}
+	if (((flags & MAP_ANON) != 0) != (v == NULL))
+	{
+		return EINVAL;
+	}
+	if (len > USERSPACETOP)
+	{
+		return ENOMEM;
+	}
+	size = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	if (v != NULL)
+	{
+		result = VOP_MMAP(v);
+		if (result)
+		{
+			return result;
+		}
+		result = VOP_STAT(v, &st);
+		if (result)
+		{
+			return result;
+		}
+	}
+
+	if (vm_stackmaxpages + VM_STACKGUARD > USERSTACK / PAGE_SIZE)
 	{
 		return ENOMEM;
 	}
+	top = USERSTACK - (vm_stackmaxpages + VM_STACKGUARD) * PAGE_SIZE;
+	floor = as->as_heap.rg_vbase +
+			(as->as_heap.rg_npages + VM_STACKGUARD) * PAGE_SIZE;
 
-	as->as_pbase_data = getppages(as->as_npages_data);
-	if (as->as_pbase_data == 0)
+	prevp = &as->as_mmaps;
+	for (mm = *prevp; mm != NULL; mm = *prevp)
+	{
+		if (top >= mm->rg_vbase + mm->rg_npages * PAGE_SIZE + size)
+		{
+			break;
+		}
+		if (mm->rg_vbase < top)
+		{
+			top = mm->rg_vbase;
+		}
+		prevp = &mm->rg_next;
+	}
+	if (top < floor || top - floor < size)
 	{
 		return ENOMEM;
 	}
 
-	as->as_pbase_stack = getppages(DUMBVM_STACKPAGES);
-	if (as->as_pbase_stack == 0)
+	rg = kmalloc(sizeof(*rg));
+	if (rg == NULL)
 	{
 		return ENOMEM;
 	}
+	as_init_region(rg);
+	rg->rg_vbase = top - size;
+	rg->rg_npages = size / PAGE_SIZE;
+	rg->rg_readonly = (prot & PROT_WRITE) == 0;
+	/* (Anonymous memory is only shared with ourselves: no fork.) */
+	rg->rg_shared = (flags & MAP_SHARED) != 0;
+	if (v != NULL)
+	{
+		VOP_INCREF(v);
+		rg->rg_vnode = v;
+		rg->rg_offset = offset;
+		rg->rg_fileva = rg->rg_vbase;
+		if (offset < st.st_size)
+		{
+			rg->rg_filesize = st.st_size - offset < (off_t)len ?
+								  st.st_size - offset : len;
+		}
+	}
 
-	as_zero_region(as->as_pbase_code, as->as_npages_code);
-	as_zero_region(as->as_pbase_data, as->as_npages_data);
-	as_zero_region(as->as_pbase_stack, DUMBVM_STACKPAGES);
+	spinlock_acquire(&as->as_lock);
+	rg->rg_next = *prevp;
+	*prevp = rg;
+	spinlock_release(&as->as_lock);
 
+	*ret = rg->rg_vbase;
 	return 0;
 }
 
-int as_complete_load(struct addrspace *as)
+/*
+ * Unmap the pages of mmap regions in [VADDR, VADDR+LEN). The pages
+ * go first, while their region still covers them for page-out's
+ * sake; then the region shrinks, splits in two, or goes away.
+ */
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
 {
+	struct region *rg, *tail, **prevp;
+	vaddr_t end, rgend, start, stop;
+
 	dumbvm_can_sleep();
-	(void)as;
+
+	if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || len == 0 ||
+		len > USERSPACETOP)
+	{
+		return EINVAL;
+	}
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (end < vaddr || end > USERSPACETOP)
+	{
+		return EINVAL;
+	}
+
+	prevp = &as->as_mmaps;
+	while ((rg = *prevp) != NULL)
+	{
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		start = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+		stop = end < rgend ? end : rgend;
+		if (start >= stop)
+		{
+			prevp = &rg->rg_next;
+			continue;
+		}
+
+		tail = NULL;
+		if (start > rg->rg_vbase && stop < rgend)
+		{
+			/* A hole: the part above becomes a region of its own. */
+			tail = kmalloc(sizeof(*tail));
+			if (tail == NULL)
+			{
+				return ENOMEM;
+			}
+			*tail = *rg;
+			tail->rg_vbase = stop;
+			tail->rg_npages = (rgend - stop) / PAGE_SIZE;
+			if (tail->rg_vnode != NULL)
+			{
+				VOP_INCREF(tail->rg_vnode);
+			}
+		}
+
+		as_unmap(as, rg, start, (stop - start) / PAGE_SIZE, true);
+
+		if (start == rg->rg_vbase && stop == rgend)
+		{
+			spinlock_acquire(&as->as_lock);
+			*prevp = rg->rg_next;
+			spinlock_release(&as->as_lock);
+			as_free_region(as, rg);
+			kfree(rg);
+			continue;
+		}
+
+		spinlock_acquire(&as->as_lock);
+		if (start == rg->rg_vbase)
+		{
+			rg->rg_vbase = stop;
+			rg->rg_npages = (rgend - stop) / PAGE_SIZE;
+		}
+		else
+		{
+			rg->rg_npages = (start - rg->rg_vbase) / PAGE_SIZE;
+		}
+		if (tail != NULL)
+		{
+			tail->rg_next = rg;
+			*prevp = tail;
+		}
+		spinlock_release(&as->as_lock);
+		prevp = &rg->rg_next;
+	}
 	return 0;
 }
 
-int as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+/*
+ * Write back the dirty pages of the shared file mappings in
+ * [VADDR, VADDR+LEN), then sync the files themselves.
+ */
+int as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
 {
-	KASSERT(as->as_pbase_stack != 0);
+	struct region *rg;
+	vaddr_t end, rgend, start, stop;
+	int result;
 
-	*stackptr = USERSTACK;
+	dumbvm_can_sleep();
+
+	if ((vaddr & ~(vaddr_t)PAGE_FRAME) != 0 || len > USERSPACETOP)
+	{
+		return EINVAL;
+	}
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+	if (end < vaddr)
+	{
+		return EINVAL;
+	}
+
+	for (rg = as->as_mmaps; rg != NULL; rg = rg->rg_next)
+	{
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		start = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+		stop = end < rgend ? end : rgend;
+		if (start >= stop || !rg->rg_shared || rg->rg_vnode == NULL)
+		{
+			continue;
+		}
+
+		result = as_syncpages(as, rg, start, (stop - start) / PAGE_SIZE);
+		if (result == 0)
+		{
+			result = VOP_FSYNC(rg->rg_vnode);
+		}
+		if (result)
+		{
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Share the resident pages of a region of OLD with NEW. Writable
+ * pages become read-only copy-on-write pages in both address spaces;
+ * the first write on either side gets its own copy in vm_cowfault.
+ * Pages OLD has never touched stay unallocated in NEW too. Pages OLD
+ * has swapped out are read back into a private frame for NEW, which
+ * leaves OLD's copy on disk undisturbed.
+ */
+static int
+as_copy_region(struct addrspace *old, struct addrspace *new,
+			   struct region *rg)
+{
+	vaddr_t vaddr;
+	pte_t *oldpte, *newpte, pte;
+	paddr_t paddr;
+	size_t i;
+	int result;
+
+	for (i = 0; i < rg->rg_npages; i++)
+	{
+		vaddr = rg->rg_vbase + i * PAGE_SIZE;
+		oldpte = pt_lookup(old->as_pt, vaddr, false);
+		if (oldpte == NULL || *oldpte == 0)
+		{
+			continue;
+		}
+
+		newpte = pt_lookup(new->as_pt, vaddr, true);
+		if (newpte == NULL)
+		{
+			return ENOMEM;
+		}
+
+		spinlock_acquire(&old->as_lock);
+		pte = *oldpte;
+
+		if (pte & PTE_TRANSIT)
+		{
+			spinlock_release(&old->as_lock);
+			coremap_waitbusy(pte & PTE_FRAME);
+			i--;
+			continue;
+		}
+
+		if (pte & PTE_SWAPPED)
+		{
+			spinlock_release(&old->as_lock);
+			paddr = getppages(1);
+			if (paddr == 0)
+			{
+				return ENOMEM;
+			}
+			/* OLD can't free the slot: it isn't running. */
+			result = vm_slotin(paddr, pte);
+			if (result)
+			{
+				coremap_decref(paddr);
+				return result;
+			}
+			*newpte = paddr | PTE_VALID;
+			if (pte & (PTE_WRITE | PTE_COW))
+			{
+				*newpte |= PTE_WRITE;
+			}
+			coremap_setowner(paddr, new, vaddr);
+			continue;
+		}
+
+		KASSERT(pte & PTE_VALID);
+		if ((pte & PTE_KERNEL) == 0)
+		{
+			if (pte & PTE_WRITE)
+			{
+				pte = (pte & ~(pte_t)PTE_WRITE) | PTE_COW;
+				*oldpte = pte;
+			}
+			/* Cached frames are the page cache's, not ours. */
+			coremap_incref(pte & PTE_FRAME,
+						   (pte & PTE_CACHED) ? NULL : new, vaddr);
+			vmstats_inc(VMSTAT_COW_SHARED);
+		}
+		/* A PTE_KERNEL frame isn't ours; just share the mapping. */
+		spinlock_release(&old->as_lock);
+		*newpte = pte;
+	}
 	return 0;
 }
 
 int as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	struct region *mm, *rg, **prevp;
+	int result;
 
 	dumbvm_can_sleep();
 
@@ -534,33 +1974,79 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	new->as_vbase_code = old->as_vbase_code;
-	new->as_npages_code = old->as_npages_code;
-	new->as_vbase_data = old->as_vbase_data;
-	new->as_npages_data = old->as_npages_data;
+	new->as_code = old->as_code;
+	new->as_data = old->as_data;
+	new->as_heap = old->as_heap;
+	new->as_stack = old->as_stack;
+	new->as_break = old->as_break;
+	if (new->as_code.rg_vnode != NULL)
+	{
+		VOP_INCREF(new->as_code.rg_vnode);
+	}
+	if (new->as_data.rg_vnode != NULL)
+	{
+		VOP_INCREF(new->as_data.rg_vnode);
+	}
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new))
+	result = as_copy_region(old, new, &old->as_code);
+	if (result == 0)
 	{
-		as_destroy(new);
-		return ENOMEM;
+		result = as_copy_region(old, new, &old->as_data);
+	}
+	if (result == 0)
+	{
+		result = as_copy_region(old, new, &old->as_heap);
+	}
+	if (result == 0)
+	{
+		result = as_copy_region(old, new, &old->as_stack);
 	}
 
-	KASSERT(new->as_pbase_code != 0);
-	KASSERT(new->as_pbase_data != 0);
-	KASSERT(new->as_pbase_stack != 0);
+	/*
+	 * Private mappings are copied like the other regions. Shared
+	 * file mappings are written back instead, so that the child can
+	 * read its pages from the file; the two are not kept coherent
+	 * after that.
+	 */
+	prevp = &new->as_mmaps;
+	for (mm = old->as_mmaps; mm != NULL && result == 0; mm = mm->rg_next)
+	{
+		rg = kmalloc(sizeof(*rg));
+		if (rg == NULL)
+		{
+			result = ENOMEM;
+			break;
+		}
+		*rg = *mm;
+		rg->rg_next = NULL;
+		if (rg->rg_vnode != NULL)
+		{
+			VOP_INCREF(rg->rg_vnode);
+		}
+		*prevp = rg;
+		prevp = &rg->rg_next;
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase_code),
-			(const void *)PADDR_TO_KVADDR(old->as_pbase_code),
-			old->as_npages_code * PAGE_SIZE);
+		if (mm->rg_shared && mm->rg_vnode != NULL)
+		{
+			result = as_syncpages(old, mm, mm->rg_vbase, mm->rg_npages);
+		}
+		else
+		{
+			result = as_copy_region(old, new, mm);
+		}
+	}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase_data),
-			(const void *)PADDR_TO_KVADDR(old->as_pbase_data),
-			old->as_npages_data * PAGE_SIZE);
+	/*
+	 * OLD's pages may have just lost write permission; drop any
+	 * writable translations for them the TLBs still hold.
+	 */
+	vm_tlb_flushas(old, true);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase_stack),
-			(const void *)PADDR_TO_KVADDR(old->as_pbase_stack),
-			DUMBVM_STACKPAGES * PAGE_SIZE);
+	if (result)
+	{
+		as_destroy(new);
+		return result;
+	}
 
 	*ret = new;
 	return 0;
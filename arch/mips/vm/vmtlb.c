@@ -0,0 +1,555 @@
+/*
+ * TLB management for MY_VM: loading translations, choosing victims
+ * when the TLB is full, and per-cpu fill/eviction counts.
+ *
+ * Three replacement policies are available, switchable at runtime
+ * with the "tlb" menu command:
+ *
+ *    rr      round-robin over the slots, per cpu.
+ *    random  let the hardware pick (tlb_random).
+ *    lru     approximate LRU with a clock over the slots. The MIPS
+ *            TLB has no referenced bit, so software never sees a
+ *            TLB hit; the only reuse signal it gets is a page that
+ *            was evicted recently and faulted straight back in. Such
+ *            a page is loaded with its reference bit set and so gets
+ *            passed over once by the clock hand.
+ *
+ * Entries are tagged with an address space ID (the TLBHI_PID field),
+ * so the TLB need not be flushed on a context switch: each cpu hands
+ * out its own ASIDs, to address spaces as they are activated on it.
+ * When it runs out, it starts a new generation: it flushes its TLB
+ * and every ASID handed out in earlier generations becomes stale,
+ * to be replaced by a fresh one when its address space next runs on
+ * that cpu. An ASID is therefore kept as a 32-bit number, generation
+ * above the PID, and 0 never names a current ASID.
+ *
+ * An address space's translations on a cpu it is not running on
+ * can be dropped wholesale by just forgetting its ASID there
+ * (vm_tlb_flushas). TLB shootdowns use this too, so only the cpus
+ * actually running the address space get an IPI. Each address
+ * space's as_lock keeps the two sides in step: it is held while a
+ * cpu activates the address space, and while a shootdown decides
+ * which cpus to interrupt and which to make forget the ASID.
+ *
+ * Most misses never get here. Activating an address space also
+ * publishes its page table in tlb_ptroot[], and the UTLB refill
+ * handler in exception-mips1.S walks that table itself and loads
+ * resident pages with tlbwr, without saving a trapframe. Only misses
+ * on pages that aren't resident, and the TLB-modify and kernel-space
+ * faults, come through vm_fault and vm_tlb_load. The fast path sets
+ * the coremap reference bit just as vm_maptlb does and counts its
+ * refills per cpu in tlb_fastrefills[], which the statistics add to
+ * the misses; but it picks slots at random, so the replacement
+ * policy only governs slow fills, and anything that works by
+ * catching misses to resident pages in vm_fault (fault-around, for
+ * one) only sees them with the fast path off. So it is off unless
+ * turned on with "tlb fast" ("tlb slow" turns it off again), and
+ * vm_tlb_setfastrefill lets tests do the same.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <addrspace.h>
+#include <vm.h>
+#include "opt-hashpt.h"
+
+/* Number of recent victims remembered for the lru policy. */
+#define TLB_NGHOSTS 32
+
+/* Parts of an ASID. */
+#define ASID_PID(asid)	((asid) % NUM_TLBPID)
+#define ASID_GEN(asid)	((asid) / NUM_TLBPID)
+
+struct tlbstate {
+	unsigned tlbs_used;		/* slots filled since the last flush */
+	unsigned tlbs_hand;		/* rr/lru: next slot to consider */
+	uint64_t tlbs_ref;		/* lru: one reference bit per slot */
+	uint32_t tlbs_ghosts[TLB_NGHOSTS];	/* lru: recent victims' EntryHi */
+	unsigned tlbs_nextghost;
+	uint32_t tlbs_lastasid;		/* last ASID handed out */
+	struct cpu *tlbs_cpu;		/* the cpu, once it has activated */
+	struct addrspace *tlbs_curas;	/* whose ASID is loaded */
+	uint32_t tlbs_pid;		/* ...and its PID */
+	unsigned tlbs_fills;		/* translations loaded on a miss */
+	unsigned tlbs_preloads;		/* ...and ahead of one (fault-around) */
+	unsigned tlbs_evictions;	/* ...that replaced a valid one */
+	unsigned tlbs_switches;		/* activations of another as */
+	unsigned tlbs_sameas;		/* ...of the one already loaded */
+	unsigned tlbs_rollovers;	/* new ASID generations */
+	unsigned tlbs_shootdowns;	/* shootdowns started here */
+	unsigned tlbs_ipis;		/* ...IPIs they sent */
+	unsigned tlbs_forgotten;	/* ...cpus that just lost the ASID */
+	unsigned tlbs_fullflushes;	/* calls to vm_tlb_flush */
+};
+
+/*
+ * Indexed by cpu number. Each cpu only touches its own entry, with
+ * interrupts off.
+ */
+static struct tlbstate tlbstates[MAXCPUS];
+
+static int tlb_policy = TLBPOLICY_RR;
+
+/*
+ * Page table of the address space active on each cpu, for the UTLB
+ * refill handler, or NULL to send every miss to vm_fault. Only the
+ * cpu itself sets its entry, with interrupts off; others may clear
+ * it (vm_tlb_forget), which at worst costs a trip through vm_fault.
+ */
+struct pagetable *tlb_ptroot[MAXCPUS];
+
+/* Misses handled by the refill handler, per cpu; only it writes them. */
+uint32_t tlb_fastrefills[MAXCPUS];
+/*
+ * Off by default, so that the replacement policy and fault-around see
+ * every miss. (It can't be turned on with hashed page tables: the
+ * refill handler only knows how to walk two-level tables.)
+ */
+static bool tlb_fastrefill = false;
+
+static const char *const tlb_policynames[] = {
+	[TLBPOLICY_RR] = "rr",
+	[TLBPOLICY_RANDOM] = "random",
+	[TLBPOLICY_LRU] = "lru",
+};
+#define NUM_TLBPOLICIES (sizeof(tlb_policynames) / sizeof(tlb_policynames[0]))
+
+#define TLB_BIT(i) ((uint64_t)1 << (i))
+
+/*
+ * Invalidate every entry in the TLB, leaving the current PID loaded.
+ * Called with interrupts off.
+ */
+static
+void
+tlb_flushall(struct tlbstate *ts)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setpid(ts->tlbs_pid);
+
+	ts->tlbs_used = 0;
+	ts->tlbs_hand = 0;
+	ts->tlbs_ref = 0;
+
+	/* A new generation may give these PIDs to other address spaces. */
+	for (i=0; i<TLB_NGHOSTS; i++) {
+		ts->tlbs_ghosts[i] = 0;
+	}
+}
+
+static
+bool
+tlb_asidvalid(struct tlbstate *ts, uint32_t asid)
+{
+	return asid != 0 && ASID_GEN(asid) == ASID_GEN(ts->tlbs_lastasid);
+}
+
+/*
+ * Hand out the next ASID, starting a new generation if the PIDs have
+ * run out. PID 0 is never used, so that no ASID is 0. Called with
+ * interrupts off.
+ */
+static
+uint32_t
+tlb_newasid(struct tlbstate *ts)
+{
+	ts->tlbs_lastasid++;
+	if (ASID_PID(ts->tlbs_lastasid) == 0) {
+		tlb_flushall(ts);
+		ts->tlbs_rollovers++;
+		ts->tlbs_lastasid++;
+	}
+	return ts->tlbs_lastasid;
+}
+
+/*
+ * True if EHI (page and PID) was evicted recently. The same page of
+ * another address space doesn't count.
+ */
+static
+bool
+tlb_isghost(struct tlbstate *ts, uint32_t ehi)
+{
+	unsigned i;
+
+	for (i=0; i<TLB_NGHOSTS; i++) {
+		if (ts->tlbs_ghosts[i] == ehi) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Pick the slot to replace under the lru policy: the first slot at
+ * or after the hand whose reference bit is clear, clearing the bits
+ * of the slots passed over.
+ */
+static
+unsigned
+tlb_clockvictim(struct tlbstate *ts)
+{
+	unsigned slot;
+
+	while (1) {
+		slot = ts->tlbs_hand;
+		ts->tlbs_hand = (ts->tlbs_hand + 1) % NUM_TLB;
+		if ((ts->tlbs_ref & TLB_BIT(slot)) == 0) {
+			return slot;
+		}
+		ts->tlbs_ref &= ~TLB_BIT(slot);
+	}
+}
+
+void
+vm_tlb_load(vaddr_t vaddr, uint32_t elo, bool preload)
+{
+	struct tlbstate *ts;
+	uint32_t ehi, oldehi, oldelo;
+	int slot, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ts = &tlbstates[curcpu->c_number];
+
+	ehi = (vaddr & TLBHI_VPAGE) | (ts->tlbs_pid << TLBHI_PIDSHIFT);
+
+	slot = tlb_probe(ehi, 0);
+	if (slot >= 0) {
+		/* Already loaded (a write to a copy-on-write page). */
+		tlb_write(ehi, elo, slot);
+		ts->tlbs_ref |= TLB_BIT(slot);
+		splx(spl);
+		return;
+	}
+
+	if (preload) {
+		ts->tlbs_preloads++;
+	}
+	else {
+		ts->tlbs_fills++;
+	}
+
+	if (ts->tlbs_used < NUM_TLB) {
+		/* Still slots that haven't been used since the flush. */
+		slot = ts->tlbs_used++;
+	}
+	else {
+		ts->tlbs_evictions++;
+		switch (tlb_policy) {
+		    case TLBPOLICY_RANDOM:
+			tlb_random(ehi, elo);
+			splx(spl);
+			return;
+		    case TLBPOLICY_LRU:
+			slot = tlb_clockvictim(ts);
+			/* (This loads the victim's PID; tlb_write fixes it.) */
+			tlb_read(&oldehi, &oldelo, slot);
+			ts->tlbs_ghosts[ts->tlbs_nextghost] = oldehi;
+			ts->tlbs_nextghost =
+				(ts->tlbs_nextghost + 1) % TLB_NGHOSTS;
+			break;
+		    default:
+			slot = ts->tlbs_hand;
+			ts->tlbs_hand = (ts->tlbs_hand + 1) % NUM_TLB;
+			break;
+		}
+	}
+
+	if (tlb_policy == TLBPOLICY_LRU && tlb_isghost(ts, ehi)) {
+		ts->tlbs_ref |= TLB_BIT(slot);
+	}
+	else {
+		ts->tlbs_ref &= ~TLB_BIT(slot);
+	}
+
+	tlb_write(ehi, elo, slot);
+	splx(spl);
+}
+
+void
+vm_tlb_flush(void)
+{
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	tlb_flushall(&tlbstates[curcpu->c_number]);
+	tlbstates[curcpu->c_number].tlbs_fullflushes++;
+	splx(spl);
+}
+
+void
+vm_tlb_activate(struct addrspace *as)
+{
+	struct tlbstate *ts;
+	unsigned cpunum;
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	cpunum = curcpu->c_number;
+	ts = &tlbstates[cpunum];
+	ts->tlbs_cpu = curcpu->c_self;
+
+	spinlock_acquire(&as->as_lock);
+	if (!tlb_asidvalid(ts, as->as_asid[cpunum])) {
+		as->as_asid[cpunum] = tlb_newasid(ts);
+	}
+	else if (as == ts->tlbs_curas) {
+		/* Back to the same process (perhaps via a kernel thread). */
+		tlb_ptroot[cpunum] = tlb_fastrefill ? as->as_pt : NULL;
+		spinlock_release(&as->as_lock);
+		ts->tlbs_sameas++;
+		splx(spl);
+		return;
+	}
+
+	ts->tlbs_curas = as;
+	ts->tlbs_pid = ASID_PID(as->as_asid[cpunum]);
+	tlb_setpid(ts->tlbs_pid);
+	tlb_ptroot[cpunum] = tlb_fastrefill ? as->as_pt : NULL;
+	spinlock_release(&as->as_lock);
+	ts->tlbs_switches++;
+
+	splx(spl);
+}
+
+void
+vm_tlb_forget(struct addrspace *as)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		if (tlb_ptroot[i] == as->as_pt) {
+			tlb_ptroot[i] = NULL;
+		}
+	}
+}
+
+bool
+vm_tlb_getfastrefill(void)
+{
+	return tlb_fastrefill;
+}
+
+int
+vm_tlb_setfastrefill(bool on)
+{
+	unsigned i;
+
+#if OPT_HASHPT
+	if (on) {
+		return ENOSYS;
+	}
+#endif
+	tlb_fastrefill = on;
+	if (!on) {
+		/* Cpus pick it up again at their next activation. */
+		for (i=0; i<MAXCPUS; i++) {
+			tlb_ptroot[i] = NULL;
+		}
+	}
+	return 0;
+}
+
+void
+vm_tlb_flushas(struct addrspace *as, bool local)
+{
+	struct tlbstate *ts;
+	unsigned i, cpunum;
+	int spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	cpunum = curcpu->c_number;
+	ts = &tlbstates[cpunum];
+
+	spinlock_acquire(&as->as_lock);
+	for (i=0; i<MAXCPUS; i++) {
+		if (i != cpunum) {
+			as->as_asid[i] = 0;
+		}
+	}
+
+	if (local) {
+		as->as_asid[cpunum] = 0;
+		if (as == ts->tlbs_curas) {
+			as->as_asid[cpunum] = tlb_newasid(ts);
+			ts->tlbs_pid = ASID_PID(as->as_asid[cpunum]);
+			tlb_setpid(ts->tlbs_pid);
+		}
+	}
+	spinlock_release(&as->as_lock);
+
+	splx(spl);
+}
+
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbstate *ts;
+	uint32_t asid;
+	int slot, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ts = &tlbstates[curcpu->c_number];
+
+	asid = as->as_asid[curcpu->c_number];
+	if (!tlb_asidvalid(ts, asid)) {
+		/* Nothing of AS's can be in this TLB. */
+		splx(spl);
+		return;
+	}
+
+	slot = tlb_probe((vaddr & TLBHI_VPAGE) |
+			 (ASID_PID(asid) << TLBHI_PIDSHIFT), 0);
+	if (slot >= 0) {
+		tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+	}
+	tlb_setpid(ts->tlbs_pid);
+
+	splx(spl);
+}
+
+/*
+ * Invalidate the N pages of AS in VADDRS everywhere. Cpus that have
+ * run AS but aren't running it now are simply made to forget its
+ * ASID, which costs them nothing until AS next runs there. Each cpu
+ * that is running AS gets one IPI with the whole batch, or a request
+ * to flush everything if the batch is too big for its queue.
+ */
+void
+vm_tlb_shootdown(struct addrspace *as, const vaddr_t *vaddrs, unsigned n)
+{
+	struct tlbshootdown batch[TLBSHOOTDOWN_MAX];
+	struct cpu *targets[MAXCPUS];
+	unsigned tickets[MAXCPUS];
+	struct tlbstate *ts;
+	unsigned i, cpunum, ntargets, nforgotten;
+	int spl;
+
+	for (i=0; i<n && i<TLBSHOOTDOWN_MAX; i++) {
+		batch[i].ts_as = as;
+		batch[i].ts_vaddr = vaddrs[i];
+	}
+
+	/*
+	 * Pick the targets. Another cpu can't start running AS
+	 * (and so pick up an ASID we think is gone) while we hold
+	 * as_lock, since vm_tlb_activate takes it. Holding it also
+	 * keeps interrupts off, so we can't migrate between cleaning
+	 * our own TLB and skipping our cpu below.
+	 */
+	ntargets = nforgotten = 0;
+	spinlock_acquire(&as->as_lock);
+	cpunum = curcpu->c_number;
+	for (i=0; i<n; i++) {
+		vm_tlb_invalidate(as, vaddrs[i]);
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		if (i == cpunum || as->as_asid[i] == 0) {
+			continue;
+		}
+		if (tlbstates[i].tlbs_curas == as) {
+			targets[ntargets++] = tlbstates[i].tlbs_cpu;
+		}
+		else {
+			as->as_asid[i] = 0;
+			nforgotten++;
+		}
+	}
+	spinlock_release(&as->as_lock);
+
+	for (i=0; i<ntargets; i++) {
+		tickets[i] = ipi_tlbshootdown_many(targets[i],
+			n <= TLBSHOOTDOWN_MAX ? batch : NULL, n);
+	}
+	for (i=0; i<ntargets; i++) {
+		ipi_tlbshootdown_wait(targets[i], tickets[i]);
+	}
+
+	/* We may have migrated while waiting; count it where we are. */
+	spl = splhigh();
+	ts = &tlbstates[curcpu->c_number];
+	ts->tlbs_shootdowns++;
+	ts->tlbs_ipis += ntargets;
+	ts->tlbs_forgotten += nforgotten;
+	splx(spl);
+}
+
+int
+vm_tlb_setpolicy(const char *name)
+{
+	unsigned i, j;
+
+	for (i=0; i<NUM_TLBPOLICIES; i++) {
+		if (!strcmp(name, tlb_policynames[i])) {
+			tlb_policy = i;
+			/* Start counting afresh for the new policy. */
+			for (j=0; j<MAXCPUS; j++) {
+				tlbstates[j].tlbs_fills = 0;
+				tlbstates[j].tlbs_preloads = 0;
+				tlb_fastrefills[j] = 0;
+				tlbstates[j].tlbs_evictions = 0;
+				tlbstates[j].tlbs_switches = 0;
+				tlbstates[j].tlbs_sameas = 0;
+				tlbstates[j].tlbs_rollovers = 0;
+				tlbstates[j].tlbs_shootdowns = 0;
+				tlbstates[j].tlbs_ipis = 0;
+				tlbstates[j].tlbs_forgotten = 0;
+				tlbstates[j].tlbs_fullflushes = 0;
+			}
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void
+vm_tlb_printstats(void)
+{
+
+	struct tlbstate *ts;
+	unsigned i, permil, misses;
+
+	kprintf("TLB replacement policy: %s, refill fast path %s\n",
+		tlb_policynames[tlb_policy], tlb_fastrefill ? "on" : "off");
+	if (tlb_fastrefill) {
+		kprintf("(fast refills pick random slots and skip "
+			"fault-around; the policy only governs fills)\n");
+	}
+	for (i=0; i<MAXCPUS; i++) {
+		ts = &tlbstates[i];
+		if (ts->tlbs_cpu == NULL) {
+			continue;
+		}
+		misses = ts->tlbs_fills + tlb_fastrefills[i];
+		kprintf("cpu%u: %u fills, %u preloads, %u evictions, "
+			"%u fast refills\n", i, ts->tlbs_fills,
+			ts->tlbs_preloads, ts->tlbs_evictions,
+			tlb_fastrefills[i]);
+		/* Misses per switch, in thousandths. */
+		permil = ts->tlbs_switches == 0 ? 0 :
+			(uint64_t)misses * 1000 / ts->tlbs_switches;
+		kprintf("cpu%u: %u switches (%u.%03u misses per switch), "
+			"%u same-as activations, %u ASID rollovers\n", i,
+			ts->tlbs_switches, permil / 1000, permil % 1000,
+			ts->tlbs_sameas, ts->tlbs_rollovers);
+		kprintf("cpu%u: %u shootdowns sent (%u IPIs, %u cpus "
+			"skipped), %u full flushes\n", i,
+			ts->tlbs_shootdowns, ts->tlbs_ipis, ts->tlbs_forgotten,
+			ts->tlbs_fullflushes);
+	}
+}
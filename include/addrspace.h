@@ -34,11 +34,44 @@
  * Address space structure and operations.
  */
 
+#include <spinlock.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
 
+/*
+ * A region is a page-aligned range of user virtual addresses. Under
+ * MY_VM no memory is allocated for a region when it is defined; each
+ * page gets a frame the first time it is touched (see vm_fault).
+ *
+ * A region loaded from an executable also records where its contents
+ * come from: FILESIZE bytes of vnode VNODE starting at file offset
+ * OFFSET, to be placed at address FILEVA. A page is read in from the
+ * file when first touched; anything not covered by the file is zero.
+ * Pages of read-only private file regions are shared between all
+ * address spaces mapping the same file through the page cache
+ * (pagecache.h).
+ *
+ * Regions made by mmap are kept on a list sorted by descending
+ * address. A SHARED file region writes its dirty pages back to the
+ * file, on munmap, msync, page-out and when the address space goes
+ * away; its pages stay read-only in the TLB until first written, so
+ * that a writable page (PTE_WRITE) is also a dirty one.
+ */
+struct region {
+        vaddr_t rg_vbase;               /* first address (page-aligned) */
+        size_t rg_npages;               /* length in pages */
+        bool rg_readonly;               /* not writeable */
+        bool rg_shared;                 /* writes go back to the file */
+        struct vnode *rg_vnode;         /* backing file, or NULL */
+        off_t rg_offset;                /* file offset of FILEVA */
+        vaddr_t rg_fileva;              /* where the file data goes */
+        size_t rg_filesize;             /* bytes of file data */
+        struct region *rg_next;         /* next mmap region */
+};
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -58,13 +91,15 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        vaddr_t as_vbase_code;
-        paddr_t as_pbase_code;
-        size_t as_npages_code;
-        vaddr_t as_vbase_data;
-        paddr_t as_pbase_data;
-        size_t as_npages_data;
-        paddr_t as_pbase_stack;
+        struct region as_code;
+        struct region as_data;
+        struct region as_heap;          /* grows with sbrk */
+        struct region as_stack;
+        struct region *as_mmaps;        /* mmap regions, highest first */
+        vaddr_t as_break;               /* end of the heap, from sbrk */
+        struct pagetable *as_pt;        /* virtual page -> frame */
+        struct spinlock as_lock;        /* protects the page table entries */
+        uint32_t as_asid[MAXCPUS];      /* TLB address space ID per cpu */
 #endif
 };
 
@@ -96,6 +131,11 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_file - arrange for FILESIZE bytes of vnode V at OFFSET
+ *                to appear at VADDR, within a region already defined
+ *                with as_define_region, when the pages are touched.
+ *                Takes its own reference to V.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -106,6 +146,23 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_sbrk   - move the end of the heap region, which starts right
+ *                after the last region defined, by AMOUNT bytes.
+ *                Hands back the old end.
+ *
+ *    as_mmap   - map LEN bytes of anonymous memory (V == NULL) or of
+ *                vnode V from page-aligned OFFSET, with the PROT_* and
+ *                MAP_* flags of <kern/mman.h>, at an address chosen
+ *                below the stack. Hands back the address. Takes its
+ *                own reference to V.
+ *
+ *    as_munmap - unmap whatever is mapped by mmap in [VADDR, VADDR+LEN),
+ *                writing dirty shared file pages back first. Mappings
+ *                partly in the range are trimmed or split.
+ *
+ *    as_msync  - write back the dirty pages of shared file mappings in
+ *                [VADDR, VADDR+LEN) and VOP_FSYNC their files.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -125,10 +182,21 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
 int               as_define_kernel_region(struct addrspace *as, vaddr_t vaddr, paddr_t paddr, size_t npages);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *ret);
+int               as_mmap(struct addrspace *as, size_t len, int prot,
+                          int flags, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t len);
+int               as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
 
 
 /*
@@ -0,0 +1,108 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame allocator for MY_VM.
+ *
+ * The coremap has one entry per physical page frame. Free frames are
+ * kept by a binary buddy allocator: a free block of order N is 2^N
+ * frames long and starts on a 2^N-frame boundary, and there is one
+ * free list per order. Allocating rounds the request up to a power
+ * of two, splits a larger block if necessary, and gives back the
+ * unused tail; freeing merges a block with its buddy for as long as
+ * the buddy is free too. Both are O(log n) in the size of RAM.
+ *
+ * Single frames, by far the most common request, normally don't get
+ * as far as the buddy lists: each cpu keeps a small cache of free
+ * frames in struct cpu (c_pagecache) that is refilled from and
+ * drained to the free lists in batches, so the global coremap lock
+ * is only taken once per batch. A multi-page allocation that finds
+ * no block big enough first empties every cpu's cache back into the
+ * free lists, where the frames can merge again, and tries once more.
+ *
+ * Frames below the first free address at bootstrap time (the kernel
+ * image and anything grabbed with ram_stealmem before the coremap
+ * existed) are never handed out, and freeing them does nothing.
+ *
+ * Functions:
+ *     coremap_bootstrap - take over physical memory from ram.c.
+ *     coremap_active    - true once coremap_bootstrap has run.
+ *     coremap_alloc     - allocate NPAGES physically contiguous frames.
+ *                         Returns 0 if no block is large enough.
+ *     coremap_free      - free NPAGES frames starting at PADDR. If
+ *                         NPAGES is 0, free the whole allocation that
+ *                         coremap_alloc returned at PADDR.
+ *     coremap_incref    - add a reference to the (user page) frame at
+ *                         PADDR, for sharing it copy-on-write, on
+ *                         behalf of AS's mapping at VADDR (or AS ==
+ *                         NULL if it isn't a mapping).
+ *     coremap_decref    - drop a reference; frees the frame when the
+ *                         last one goes, and makes the last mapping
+ *                         left the owner again if it knows which.
+ *     coremap_getref    - return the current reference count.
+ *     coremap_nframes   - number of frames the coremap manages.
+ *     coremap_nfree     - number of them currently free (a hint).
+ *
+ * Page replacement. Each user page that is mapped by exactly one
+ * address space is entered in a reverse map (owner and virtual
+ * address); shared frames remember their mappings so the owner comes
+ * back when the sharing ends. A clock over the coremap picks victims
+ * among owned frames;
+ * see coremap.c for the details and my_vm.c for the page-out
+ * protocol.
+ *
+ *     coremap_setowner    - set (or with AS == NULL clear) the owner.
+ *     coremap_clearowner  - clear the owner, and forget AS's mapping
+ *                           at VADDR if the frame is shared, unless
+ *                           the frame is busy.
+ *     coremap_pin         - keep the frame from being picked, unless
+ *                           it is busy already.
+ *     coremap_unpin       - undo coremap_pin.
+ *     coremap_touch       - note that the page was just used.
+ *                           This sets the frame's byte in
+ *                           coremap_refbits[], which the UTLB refill
+ *                           handler also stores to directly.
+ *     coremap_pickvictim  - choose a page to evict, looking at no more
+ *                           than MAXSCAN frames, and mark it busy.
+ *     coremap_unbusy      - clear the busy mark and wake waiters.
+ *     coremap_waitbusy    - sleep until the frame is not busy.
+ *
+ * Page merging (see ksm.h) uses the same owners and busy marks:
+ *
+ *     coremap_pickmerge   - choose the next candidate page, looking at
+ *                           no more than MAXSCAN frames, and mark it
+ *                           busy.
+ *     coremap_trybusy     - mark a given frame busy if it is still a
+ *                           candidate, and return its owner.
+ */
+
+struct addrspace;
+
+#define CM_MAXORDER	10	/* largest block is 2^10 pages (4M) */
+
+void coremap_bootstrap(void);
+bool coremap_active(void);
+paddr_t coremap_alloc(unsigned long npages);
+void coremap_free(paddr_t paddr, unsigned long npages);
+void coremap_incref(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_decref(paddr_t paddr);
+unsigned coremap_getref(paddr_t paddr);
+unsigned coremap_nframes(void);
+unsigned coremap_nfree(void);
+
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+bool coremap_clearowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+bool coremap_pin(paddr_t paddr);
+void coremap_unpin(paddr_t paddr);
+void coremap_touch(paddr_t paddr);
+extern uint8_t *coremap_refbits;	/* by physical frame number */
+paddr_t coremap_pickvictim(unsigned maxscan, unsigned *scanned,
+			   struct addrspace **as_ret, vaddr_t *vaddr_ret);
+paddr_t coremap_pickmerge(unsigned maxscan, unsigned *scanned,
+			  struct addrspace **as_ret, vaddr_t *vaddr_ret);
+bool coremap_trybusy(paddr_t paddr, struct addrspace **as_ret,
+		     vaddr_t *vaddr_ret);
+void coremap_unbusy(paddr_t paddr);
+void coremap_waitbusy(paddr_t paddr);
+
+#endif /* _COREMAP_H_ */
@@ -36,6 +36,10 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/* Maximum number of free page frames cached per cpu. */
+#define CPU_PAGECACHE_MAX 32
+
+
 /*
  * Per-cpu structure
  *
@@ -62,6 +66,20 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed by this cpu, and by others only to drain it.
+	 * Protected by the page cache lock.
+	 *
+	 * A small stack of free page frames kept back from the
+	 * coremap so that single-page allocations and frees don't
+	 * need the global coremap lock. Refilled and drained in
+	 * batches by the coremap code, and emptied entirely when a
+	 * multi-page allocation can't otherwise be met.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_npagecache;
+	struct spinlock c_pagecache_lock;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -77,7 +95,10 @@ struct cpu {
 	 * TLB shootdown requests made to this CPU are queued in
 	 * c_shootdown[], with c_numshootdown holding the number of
 	 * requests. TLBSHOOTDOWN_MAX is the maximum number that can
-	 * be queued at once, which is machine-dependent.
+	 * be queued at once, which is machine-dependent. Past that,
+	 * c_shootdown_all is set and the whole TLB is flushed instead.
+	 * c_shootdowns_done counts the times the queue has been
+	 * processed, so senders can tell when theirs has been.
 	 *
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
@@ -86,6 +107,8 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_all;
+	unsigned c_shootdowns_done;
 	struct spinlock c_ipi_lock;
 };
 
@@ -150,6 +173,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_many sends several shootdowns with one IPI (or, if
+ * MAPPINGS is NULL, asks for the whole TLB to be flushed), and
+ * returns a ticket that ipi_tlbshootdown_wait takes to wait until the
+ * target CPU has done them.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -164,6 +191,10 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_many(struct cpu *target,
+			       const struct tlbshootdown *mappings,
+			       unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,22 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), for libc's <sys/mman.h>.
+ */
+
+/* Protections: PROT_NONE or any combination of the others. */
+#define PROT_NONE	0
+#define PROT_READ	1
+#define PROT_WRITE	2
+#define PROT_EXEC	4
+
+/* Flags: exactly one of MAP_SHARED and MAP_PRIVATE, plus MAP_ANON. */
+#define MAP_SHARED	1	/* writes go back to the file */
+#define MAP_PRIVATE	2	/* writes are private to the process */
+#define MAP_ANON	4	/* zero-filled memory, not a file */
+
+/* Returned by mmap at user level on error. */
+#define MAP_FAILED	((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,46 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches for fixed-size kernel structures.
+ *
+ * A cache hands out objects of one exact size, packed into whole
+ * pages ("slabs"), instead of rounding each one up to a kmalloc block
+ * size. Each slab starts with a small header holding a stack of its
+ * free objects, so kmem_cache_free finds it from the object's address.
+ *
+ * An optional constructor is run on each object when its slab is
+ * made, and the destructor when the slab is given back. Objects must
+ * be freed in their constructed state, and come back out that way, so
+ * things that survive from one use of an object to the next (locks,
+ * semaphores, list nodes) are only set up once. Each cache keeps one
+ * completely free slab around rather than releasing it at once, so a
+ * create/destroy cycle doesn't rebuild a slab every time.
+ *
+ * Functions:
+ *     kmem_cache_create     - make a cache for objects of SIZE bytes
+ *                             (at most a quarter of a page). CTOR and
+ *                             DTOR may be NULL; CTOR returns an error
+ *                             code, and on failure must leave nothing
+ *                             for DTOR to undo.
+ *     kmem_cache_destroy    - destroy a cache. All its objects must
+ *                             have been freed.
+ *     kmem_cache_alloc      - get a constructed object; NULL if out of
+ *                             memory or the constructor fails.
+ *     kmem_cache_free       - give an object back, constructed.
+ *     kmem_cache_memory     - bytes of slabs the cache holds.
+ *     kmem_cache_printstats - print statistics for every cache.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+size_t kmem_cache_memory(struct kmem_cache *kc);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
@@ -0,0 +1,45 @@
+#ifndef _KSM_H_
+#define _KSM_H_
+
+/*
+ * Same-page merging for MY_VM.
+ *
+ * Many copies of the same program hold many identical private pages
+ * (zero-filled buffers, constant tables, code). A kernel thread walks
+ * the coremap with a hand of its own (coremap_pickmerge), hashes each
+ * unshared user page, and looks the hash up:
+ *
+ *    - in the stable table, of frames already merged. If the page
+ *      matches one byte for byte, it is remapped to that frame and
+ *      its own frame is freed.
+ *    - in the unstable table, of pages seen earlier in this pass. If
+ *      the two match, the earlier one becomes a merged frame (moving
+ *      to the stable table) and this one is remapped to it.
+ *    - otherwise the page goes in the unstable table.
+ *
+ * Pages are write-protected before they are compared (see my_vm.c),
+ * and merged frames are mapped copy-on-write, so a write to one
+ * takes a VM_FAULT_READONLY fault and vm_cowfault gives the writer a
+ * private copy again. The stable table keeps a reference to each
+ * merged frame; frames nobody else maps any more are dropped at the
+ * end of each pass, and the unstable table is rebuilt from scratch.
+ *
+ * The thread looks at no more than the scan rate's worth of frames
+ * a second, and yields after every page it works on, so that it only
+ * soaks up time the machine has to spare. Merged frames are shared,
+ * so they are not paged out.
+ *
+ * Functions:
+ *     ksm_bootstrap    - start the thread.
+ *     ksm_setscanrate  - set the scan rate (frames per second); 0
+ *                        stops merging.
+ *     ksm_getscanrate  - return it.
+ *     ksm_printstats   - print pages merged and frames saved.
+ */
+
+void ksm_bootstrap(void);
+void ksm_setscanrate(unsigned scanrate);
+unsigned ksm_getscanrate(void);
+void ksm_printstats(void);
+
+#endif /* _KSM_H_ */
@@ -0,0 +1,44 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for MY_VM.
+ *
+ * Read-only pages loaded from a file (in practice, program text) are
+ * kept in a hash table keyed by vnode and file offset, so that every
+ * process running the same binary maps the same frames instead of
+ * reading its own copy. The offset is that of the start of the page,
+ * and may be negative for a first page that starts before the file
+ * data does.
+ *
+ * The cache holds one coremap reference to each frame and every
+ * mapping holds another. When the last mapping goes, the page is
+ * dropped from the cache and the frame freed. Cached frames have no
+ * owner in the coremap and so are never paged out.
+ *
+ * The vnode pointer is only meaningful as a key while some address
+ * space maps the file, which the address space's own reference to
+ * the vnode guarantees.
+ *
+ * Functions:
+ *     pagecache_lookup     - return the frame caching V at OFFSET, with
+ *                            a reference for the caller, or 0.
+ *     pagecache_insert     - offer freshly read frame PADDR for V at
+ *                            OFFSET. Returns the frame the caller
+ *                            should map, with a reference for it: PADDR,
+ *                            or the frame someone else inserted first
+ *                            (PADDR is then freed). Returns 0, freeing
+ *                            PADDR, if out of memory.
+ *     pagecache_release    - drop a mapping's reference to PADDR.
+ *     pagecache_printstats - print cached frames, mappings of them and
+ *                            the ratio between the two.
+ */
+
+struct vnode;
+
+paddr_t pagecache_lookup(struct vnode *v, off_t offset);
+paddr_t pagecache_insert(struct vnode *v, off_t offset, paddr_t paddr);
+void pagecache_release(struct vnode *v, off_t offset, paddr_t paddr);
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
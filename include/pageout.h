@@ -0,0 +1,38 @@
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+/*
+ * Pageout daemon for MY_VM.
+ *
+ * A kernel thread that keeps a reserve of free frames, so that page
+ * faults seldom have to wait for a page to be written out. Whenever
+ * an allocation leaves fewer than the low watermark of frames free
+ * (and there is somewhere to put pages: swap, or the compressed
+ * store), the daemon is woken. It then runs the coremap
+ * clock (coremap_pickvictim), paging out pages through vm_evict,
+ * until the high watermark is reached. It looks at no more than the
+ * scan rate's worth of frames a second, so that a machine short of
+ * memory doesn't spend all its time in the clock; if the budget runs
+ * out first it sleeps until the next second.
+ *
+ * Allocations that find no free frame at all still page out a frame
+ * for themselves (a direct reclaim). The daemon's activity is counted
+ * in vmstats.
+ *
+ * Functions:
+ *     pageout_bootstrap - start the daemon, with watermarks and scan
+ *                         rate scaled to the size of memory.
+ *     pageout_check     - wake the daemon if memory is short. Called
+ *                         after every frame allocation.
+ *     pageout_set       - change the low and high watermarks (frames)
+ *                         and the scan rate (frames per second).
+ *                         Returns EINVAL if they make no sense.
+ *     pageout_get       - return the current settings.
+ */
+
+void pageout_bootstrap(void);
+void pageout_check(void);
+int pageout_set(unsigned lowat, unsigned hiwat, unsigned scanrate);
+void pageout_get(unsigned *lowat, unsigned *hiwat, unsigned *scanrate);
+
+#endif /* _PAGEOUT_H_ */
@@ -0,0 +1,81 @@
+#ifndef _PT_H_
+#define _PT_H_
+
+/*
+ * Per-address-space page tables for MY_VM.
+ *
+ * The page table is a two-level radix tree indexed by virtual page
+ * number. The top 10 bits of a virtual address select a second-level
+ * table of 1024 entries and the next 10 bits select the entry within
+ * it. Second-level tables are allocated the first time something in
+ * their 4M slice of the address space is mapped, so a process only
+ * pays for the parts of the address space it actually uses.
+ *
+ * Page table entries use the layout of the TLB EntryLo word, so a
+ * resident entry can be loaded straight into the TLB once the
+ * software bits are masked off:
+ *
+ *    PTE_FRAME   physical page number (TLBLO_PPAGE)
+ *    PTE_WRITE   page may be written (TLBLO_DIRTY)
+ *    PTE_VALID   page is resident in memory (TLBLO_VALID)
+ *    PTE_SWBITS  bits ignored by the hardware, used by the VM system
+ *
+ * An entry of 0 means the page has never been touched. A page that
+ * has been paged out has PTE_SWAPPED set and its swap slot number in
+ * place of the frame number (see PTE_SLOTSHIFT), with PTE_ZSTORED
+ * also set if the slot is in the compressed store rather than on the
+ * swap disk; while it is being written out it has PTE_TRANSIT set
+ * and still holds its frame.
+ *
+ * The UTLB refill handler in exception-mips1.S walks the two-level
+ * layout directly (directory at offset 0, both levels in kseg0,
+ * PTE_VALID = 0x200, 8 software bits); keep the two in step.
+ */
+
+#include <mips/tlb.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	TLBLO_PPAGE
+#define PTE_WRITE	TLBLO_DIRTY
+#define PTE_VALID	TLBLO_VALID
+#define PTE_SWBITS	0x000000ff
+
+/* Software bits */
+#define PTE_KERNEL	0x00000001	/* frame is not owned by this as */
+#define PTE_COW		0x00000002	/* shared; copy before writing */
+#define PTE_SWAPPED	0x00000004	/* not resident; slot in frame bits */
+#define PTE_TRANSIT	0x00000008	/* being paged out */
+#define PTE_CACHED	0x00000010	/* frame belongs to the page cache */
+#define PTE_ZSTORED	0x00000020	/* with SWAPPED: slot is in zstore */
+
+#define PTE_SLOTSHIFT	12
+
+#define PTE_TO_TLBLO(pte) ((pte) & ~(pte_t)PTE_SWBITS)
+
+struct pagetable;	/* Opaque. */
+
+/*
+ * Functions:
+ *     pt_create  - allocate an empty page table. Returns NULL if out
+ *                  of memory.
+ *     pt_destroy - free the page table itself. Whatever the entries
+ *                  refer to must already have been released.
+ *     pt_lookup  - return a pointer to the entry for VADDR. If the
+ *                  second-level table does not exist, allocate it if
+ *                  CREATE is set (returning NULL if out of memory)
+ *                  and otherwise return NULL. The pointer stays good
+ *                  until the page table is destroyed.
+ *     pt_memory  - bytes of memory taken by all page tables.
+ *
+ * With options hashpt (see hashpt.c) there is instead one hash table
+ * of entries for the whole system, keyed by address space and page;
+ * pt_lookup then makes or finds single entries rather than
+ * second-level tables, and the UTLB refill fast path is not used.
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+size_t pt_memory(void);
+
+#endif /* _PT_H_ */
@@ -0,0 +1,32 @@
+#ifndef _SWAPFILE_H_
+#define _SWAPFILE_H_
+
+/*
+ * Swap space for MY_VM.
+ *
+ * Swap is a raw disk device (e.g. lhd1) attached with vfs_swapon and
+ * divided into page-sized slots; a bitmap records which slots hold a
+ * page. Nothing is swapped until swap_on has been called, from the
+ * "swapon" menu command.
+ *
+ * Functions:
+ *     swap_on         - start swapping to device DEVNAME.
+ *     swap_enabled    - true if swap is on.
+ *     swap_alloc      - reserve a free slot. Returns ENOSPC if swap is
+ *                       off or full.
+ *     swap_free       - release a slot.
+ *     swap_out        - write the page in frame PADDR to SLOT.
+ *     swap_in         - read SLOT into frame PADDR.
+ *     swap_printstats - print slot usage and swap-in/swap-out counts
+ *                       and average latencies.
+ */
+
+int swap_on(const char *devname);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_out(paddr_t paddr, unsigned slot);
+int swap_in(paddr_t paddr, unsigned slot);
+void swap_printstats(void);
+
+#endif /* _SWAPFILE_H_ */
@@ -33,6 +33,7 @@
 
 #include <cdefs.h> /* for __DEAD */
 #include "opt-syscalls.h"
+#include "opt-my_vm.h"
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -65,5 +66,11 @@ int sys_write(int filehandle, const void* buf, size_t size);
 int sys_read(int filehandle, void* buf, size_t size);
 void sys__exit(int status);
 #endif
+#if OPT_MY_VM
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags,
+	     int32_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+#endif
 
 #endif /* _SYSCALL_H_ */
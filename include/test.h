@@ -93,6 +93,14 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int kmalloctest6(int, char **);
+int kmalloctest7(int, char **);
+int forkbench(int, char **);
+int mmaptest(int, char **);
+int faultaroundbench(int, char **);
+int zstoretest(int, char **);
+int ptbench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
@@ -60,6 +60,14 @@ vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
+void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * Background work for an idle cpu, called from the idle loop with
+ * interrupts off. Does a small amount and returns true if there was
+ * anything to do, or false if the cpu may as well sleep.
+ */
+bool vm_idle(void);
+
 #endif /* _VM_H_ */
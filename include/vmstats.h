@@ -0,0 +1,34 @@
+#ifndef _VMSTATS_H_
+#define _VMSTATS_H_
+
+/*
+ * Event counters for MY_VM, printed by the "vm" menu command.
+ *
+ * Functions:
+ *     vmstats_inc   - add one to counter STAT.
+ *     vmstats_add   - add N to counter STAT.
+ *     vmstats_get   - return the value of counter STAT.
+ *     vmstats_print - print all the counters.
+ */
+
+#define VMSTAT_FAULTS		0	/* calls to vm_fault */
+#define VMSTAT_ZEROFILLS	1	/* pages given a new zeroed frame */
+#define VMSTAT_COW_FAULTS	2	/* writes to copy-on-write pages */
+#define VMSTAT_COW_COPIES	3	/* ...that had to copy the page */
+#define VMSTAT_COW_SHARED	4	/* pages shared by as_copy */
+#define VMSTAT_FILEREADS	5	/* pages read in from files */
+#define VMSTAT_STACKGROWTH	6	/* pages added to stacks on fault */
+#define VMSTAT_FILEWRITES	7	/* dirty pages written back to files */
+#define VMSTAT_PAGEOUT_WAKEUPS	8	/* pageout daemon runs */
+#define VMSTAT_PAGEOUT_SCANNED	9	/* frames looked at by the clock */
+#define VMSTAT_PAGEOUT_FREED	10	/* frames freed by the daemon */
+#define VMSTAT_DIRECT_RECLAIMS	11	/* ...and by allocations themselves */
+#define VMSTAT_FAULTAROUND	12	/* extra TLB entries loaded on faults */
+#define VMSTAT_NUM		13
+
+void vmstats_inc(unsigned stat);
+void vmstats_add(unsigned stat, unsigned long n);
+unsigned long vmstats_get(unsigned stat);
+void vmstats_print(void);
+
+#endif /* _VMSTATS_H_ */
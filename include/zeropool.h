@@ -0,0 +1,30 @@
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+/*
+ * Pool of pre-zeroed page frames for MY_VM.
+ *
+ * Cpus with nothing to run zero free frames a page at a time from the
+ * idle loop (vm_idle) and keep them here, so that zero-fill faults
+ * can usually take a frame that is ready instead of clearing one on
+ * the spot. The pool is kept small and is only filled while memory
+ * is plentiful (above the pageout daemon's high watermark); when
+ * memory runs out getppages takes its frames back first.
+ *
+ * Functions:
+ *     zeropool_get        - return a zeroed frame, or 0 if the pool is
+ *                           empty. Counts a hit or a miss.
+ *     zeropool_reclaim    - return any frame from the pool, or 0, for
+ *                           an allocation that is out of memory.
+ *     zeropool_fill       - zero one more frame for the pool if it is
+ *                           not full and memory allows. Returns true
+ *                           if it did.
+ *     zeropool_printstats - print the pool size and hit rate.
+ */
+
+paddr_t zeropool_get(void);
+paddr_t zeropool_reclaim(void);
+bool zeropool_fill(void);
+void zeropool_printstats(void);
+
+#endif /* _ZEROPOOL_H_ */
@@ -0,0 +1,47 @@
+#ifndef _ZSTORE_H_
+#define _ZSTORE_H_
+
+/*
+ * Compressed in-memory page store for MY_VM.
+ *
+ * Private pages chosen for page-out go here before they go to swap:
+ * the page is compressed with a small LZ77 codec (literal runs and
+ * back references of up to 131 bytes within the page) and the result
+ * is kept in a kmalloc'd buffer, freeing the frame. A fault brings it
+ * back by decompressing into a new frame. This is much faster than
+ * the simulated disk, and works with no swap device at all.
+ *
+ * Pages that don't compress to half a page or less are refused and
+ * go to swap instead (or stay put if swap is off), as are pages that
+ * would take the store past its size cap. Slots are numbered like
+ * swap slots and recorded the same way in the page table, with
+ * PTE_ZSTORED set.
+ *
+ * Functions:
+ *     zstore_bootstrap  - set up the slot table and the default cap.
+ *     zstore_enabled    - true if the cap is not zero.
+ *     zstore_out        - compress the page in frame PADDR into a new
+ *                         slot, returned in SLOT. Returns ENOSPC if
+ *                         the store is full or off, and E2BIG if the
+ *                         page doesn't compress well enough.
+ *     zstore_in         - decompress SLOT into frame PADDR. The slot
+ *                         is kept.
+ *     zstore_free       - release a slot.
+ *     zstore_setcap     - set the cap, in pages' worth of compressed
+ *                         data; 0 turns the store off. What is already
+ *                         stored stays.
+ *     zstore_getcap     - return it.
+ *     zstore_printstats - print usage, overall and per-page
+ *                         compression ratios, and store/load counts.
+ */
+
+void zstore_bootstrap(void);
+bool zstore_enabled(void);
+int zstore_out(paddr_t paddr, unsigned *slot);
+int zstore_in(paddr_t paddr, unsigned slot);
+void zstore_free(unsigned slot);
+void zstore_setcap(unsigned npages);
+unsigned zstore_getcap(void);
+void zstore_printstats(void);
+
+#endif /* _ZSTORE_H_ */
@@ -41,9 +41,19 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include <vmstats.h>
+#include <swapfile.h>
+#include <pagecache.h>
+#include <pageout.h>
+#include <zeropool.h>
+#include <ksm.h>
+#include <zstore.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-syscalls.h"
+#include "opt-my_vm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -377,6 +387,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kmemcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -406,6 +428,201 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_MY_VM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vmstats_print();
+	pagecache_printstats();
+	zeropool_printstats();
+	zstore_printstats();
+
+	return 0;
+}
+
+static
+void
+cmd_tlbusage(void)
+{
+	kprintf("Usage: tlb [rr|random|lru|fast|slow]\n");
+	kprintf("    rr, random, lru: replacement policy for TLB fills\n");
+	kprintf("    fast: refill resident pages in the UTLB handler, "
+		"bypassing the\n");
+	kprintf("          policy (random slots) and fault-around\n");
+	kprintf("    slow: send every miss to vm_fault (the default)\n");
+}
+
+static
+int
+cmd_tlb(int nargs, char **args)
+{
+	if (nargs > 2) {
+		cmd_tlbusage();
+		return EINVAL;
+	}
+	if (nargs == 2 && !strcmp(args[1], "fast")) {
+		if (vm_tlb_setfastrefill(true)) {
+			kprintf("tlb: no fast path with hashed page tables\n");
+			return ENOSYS;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "slow")) {
+		vm_tlb_setfastrefill(false);
+	}
+	else if (nargs == 2 && vm_tlb_setpolicy(args[1])) {
+		kprintf("tlb: unknown policy %s\n", args[1]);
+		cmd_tlbusage();
+		return EINVAL;
+	}
+
+	vm_tlb_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_stackmax(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: stackmax [pages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		if (atoi(args[1]) <= 0) {
+			kprintf("Usage: stackmax [pages]\n");
+			return EINVAL;
+		}
+		vm_setstackmax(atoi(args[1]));
+	}
+
+	kprintf("Maximum user stack size: %u pages\n", vm_getstackmax());
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: faultaround [pages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		result = vm_setfaultaround(atoi(args[1]));
+		if (result) {
+			kprintf("faultaround: window must be 1 to %u pages\n",
+				VM_FAULTAROUND_MAX);
+			return result;
+		}
+	}
+
+	kprintf("Fault-around window: %u pages\n", vm_getfaultaround());
+
+	return 0;
+}
+
+static
+int
+cmd_pageout(int nargs, char **args)
+{
+	unsigned lowat, hiwat, scanrate;
+	int result;
+
+	if (nargs != 1 && nargs != 4) {
+		kprintf("Usage: pageout [lowat hiwat scanrate]\n");
+		return EINVAL;
+	}
+	if (nargs == 4) {
+		result = pageout_set(atoi(args[1]), atoi(args[2]),
+				     atoi(args[3]));
+		if (result) {
+			kprintf("pageout: %s\n", strerror(result));
+			return result;
+		}
+	}
+
+	pageout_get(&lowat, &hiwat, &scanrate);
+	kprintf("Pageout: low watermark %u frames, high watermark %u frames, "
+		"scan rate %u frames/sec\n", lowat, hiwat, scanrate);
+
+	return 0;
+}
+
+static
+int
+cmd_ksm(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: ksm [scanrate]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		ksm_setscanrate(atoi(args[1]));
+	}
+
+	ksm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_zstore(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: zstore [cap]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		zstore_setcap(atoi(args[1]));
+	}
+
+	zstore_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_swapon(int nargs, char **args)
+{
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: swapon device\n");
+		return EINVAL;
+	}
+
+	result = swap_on(args[1]);
+	if (result) {
+		kprintf("swapon: %s\n", strerror(result));
+		return result;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_swapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -470,6 +687,16 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Page allocator latency test   ",
+	"[km6] Object cache test             ",
+	"[km7] Random-order kfree benchmark  ",
+#if OPT_MY_VM
+	"[fe]  fork+exec benchmark           ",
+	"[mmt] mmap test                     ",
+	"[fab] Fault-around benchmark        ",
+	"[zst] Compressed page store test    ",
+	"[ptb] Page table benchmark          ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -509,8 +736,20 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[kc] Kernel object cache stats      ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if OPT_MY_VM
+	"[vm] VM statistics                  ",
+	"[tlb] TLB policy and statistics     ",
+	"[stackmax] Max user stack size      ",
+	"[faultaround] Fault-around window   ",
+	"[pageout] Pageout daemon settings   ",
+	"[ksm] Page merging stats and rate   ",
+	"[zstore] Compressed page store      ",
+	"[swapon] Start swapping to a disk   ",
+	"[swap] Swap statistics              ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -558,8 +797,20 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kc",         cmd_kmemcachestats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if OPT_MY_VM
+	{ "vm",         cmd_vmstats },
+	{ "tlb",        cmd_tlb },
+	{ "stackmax",   cmd_stackmax },
+	{ "faultaround", cmd_faultaround },
+	{ "pageout",    cmd_pageout },
+	{ "ksm",        cmd_ksm },
+	{ "zstore",     cmd_zstore },
+	{ "swapon",     cmd_swapon },
+	{ "swap",       cmd_swapstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -570,6 +821,16 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
+	{ "km7",	kmalloctest7 },
+#if OPT_MY_VM
+	{ "fe",		forkbench },
+	{ "mmt",	mmaptest },
+	{ "fab",	faultaroundbench },
+	{ "zst",	zstoretest },
+	{ "ptb",	ptbench },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -43,11 +43,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <kmemcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -59,6 +61,40 @@ struct proc* proc_table[TABLE_SIZE];
 int glob_proc_id;
 
 
+/*
+ * Where proc structures come from.
+ */
+static struct kmem_cache *proc_cache;
+
+/*
+ * Constructor and destructor for proc_cache. The lock and the wait
+ * semaphore are kept from one process to the next; the semaphore is
+ * back to 0 by the time a process is destroyed (see proc_destroy).
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->sem = sem_create("proc", 0);
+	if (proc->sem == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+	sem_destroy(proc->sem);
+}
+
 /*
  * Create a proc structure.
  */
@@ -68,25 +104,24 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
+	/* p_lock and sem are set up by proc_ctor */
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
-	proc->sem = sem_create(name, 0);
 
 	return proc;
 }
@@ -185,12 +220,12 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 
-	sem_destroy(proc->sem);
+	/* Any V from exit has been matched by a P in proc_wait. */
+	KASSERT(proc->sem->sem_count == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 }
 
 /*
@@ -199,6 +234,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				       proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: Out of memory\n");
+	}
+
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
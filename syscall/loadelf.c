@@ -59,7 +59,38 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-my_vm.h"
 
+#if OPT_MY_VM
+/*
+ * Set up a segment at virtual address VADDR, as below, but don't read
+ * anything yet: the address space just records where the segment is
+ * in the file, and vm_fault reads each page in (and zero-fills past
+ * FILESIZE) the first time it is touched.
+ *
+ * as_define_region has already refused segments that reach into
+ * kernel space.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+	     off_t offset, vaddr_t vaddr,
+	     size_t memsize, size_t filesize,
+	     int is_executable)
+{
+	(void)is_executable;
+
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(as, vaddr, v, offset, filesize);
+}
+#else
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +175,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* OPT_MY_VM */
 
 /*
  * Load an ELF executable user program into the current address space.
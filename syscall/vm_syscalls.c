@@ -0,0 +1,87 @@
+/*
+ * Memory management system calls for MY_VM.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return the old
+ * end.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LEN bytes at an address of the kernel's choosing (ADDR
+ * is only a hint, and is ignored) and return it.
+ *
+ * Only anonymous memory can be mapped from user level for now: a
+ * file mapping needs a file descriptor, and there is no per-process
+ * file table to look it up in yet. The kernel can map files with
+ * as_mmap directly.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	int result;
+
+	(void)addr;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	if ((flags & MAP_ANON) == 0) {
+		return EBADF;
+	}
+
+	result = as_mmap(as, len, prot, flags, NULL, 0, &vaddr);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)vaddr;
+	return 0;
+}
+
+/*
+ * munmap: unmap whatever mmap mapped in [ADDR, ADDR+LEN).
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_munmap(as, (vaddr_t)addr, len);
+}
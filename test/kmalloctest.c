@@ -33,9 +33,13 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <kmemcache.h>
 #include <test.h>
 
 #include "opt-dumbvm.h"
@@ -51,13 +55,23 @@
  * available memory.
  *
  * kmallocstress does the same thing, but from NTHREADS different
- * threads at once.
+ * threads at once. Then it times kmalloc/kfree of small blocks (the
+ * ones the per-cpu caches serve) from 1, 2, 4, ... NTHREADS threads,
+ * and reports operations per second and how many cpus the threads
+ * ran on.
  */
 
 #define NTRIES   1200
 #define ITEMSIZE  997
 #define NTHREADS  8
 
+#define KM2_OPS    8192
+#define KM2_NPTRS    16
+#define KM2_NSIZES    6	/* 16 to 512 bytes */
+
+/* The cpus each timed thread was seen on, as a bitmask. */
+static uint32_t km2_cpumasks[NTHREADS];
+
 static
 void
 kmallocthread(void *sm, unsigned long num)
@@ -97,6 +111,78 @@ done:
 	}
 }
 
+static
+void
+km2thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[KM2_NPTRS];
+	uint32_t cpumask = 0;
+	unsigned i, j;
+
+	for (j=0; j<KM2_NPTRS; j++) {
+		ptrs[j] = NULL;
+	}
+	for (i=0; i<KM2_OPS; i++) {
+		j = i % KM2_NPTRS;
+		kfree(ptrs[j]);
+		ptrs[j] = kmalloc(16 << (i % KM2_NSIZES));
+		if (ptrs[j] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			break;
+		}
+		cpumask |= 1U << (curcpu->c_number % 32);
+	}
+	for (j=0; j<KM2_NPTRS; j++) {
+		kfree(ptrs[j]);
+	}
+	km2_cpumasks[num] = cpumask;
+	V(sem);
+}
+
+/*
+ * Run NTHREADS copies of km2thread at once and print the rate.
+ */
+static
+void
+km2time(struct semaphore *sem, unsigned nthreads)
+{
+	struct timespec start, now;
+	uint64_t nsecs, ops;
+	uint32_t cpumask = 0;
+	unsigned i, ncpus = 0;
+	int result;
+
+	gettime(&start);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("km2time", NULL, km2thread, sem, i);
+		if (result) {
+			panic("kmallocstress: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&now);
+	timespec_sub(&now, &start, &now);
+	nsecs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	for (i=0; i<nthreads; i++) {
+		cpumask |= km2_cpumasks[i];
+	}
+	for (; cpumask != 0; cpumask &= cpumask - 1) {
+		ncpus++;
+	}
+
+	/* Each iteration is a kmalloc and a kfree. */
+	ops = (uint64_t)nthreads * KM2_OPS * 2;
+	kprintf("%u thread%s on %u cpu%s: %llu ops/sec\n",
+		nthreads, nthreads == 1 ? "" : "s",
+		ncpus, ncpus == 1 ? "" : "s",
+		nsecs == 0 ? 0ULL : ops * 1000000000ULL / nsecs);
+}
+
 int
 kmalloctest(int nargs, char **args)
 {
@@ -139,6 +225,12 @@ kmallocstress(int nargs, char **args)
 		P(sem);
 	}
 
+	kprintf("Timing kmalloc/kfree of %d to %d bytes...\n",
+		16, 16 << (KM2_NSIZES - 1));
+	for (i=1; i<=NTHREADS; i*=2) {
+		km2time(sem, i);
+	}
+
 	sem_destroy(sem);
 	kprintf("kmalloc stress test done\n");
 
@@ -378,3 +470,334 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Page allocator latency test. Each thread allocates and frees runs
+ * of 1, 4, and 16 pages with alloc_kpages/free_kpages, keeping a few
+ * allocations live at a time so the allocator has to split and merge
+ * blocks, and the average time per alloc_kpages call is reported for
+ * each size. The optional argument is the number of threads.
+ */
+
+#define KM5_NTRIES 400
+#define KM5_NLIVE 4
+#define NUM_KM5_SIZES 3
+static const unsigned km5_sizes[NUM_KM5_SIZES] = { 1, 4, 16 };
+static uint64_t km5_nsecs[NTHREADS][NUM_KM5_SIZES];
+static unsigned km5_count[NTHREADS][NUM_KM5_SIZES];
+
+static
+void
+kmalloctest5thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	vaddr_t live[KM5_NLIVE];
+	struct timespec before, after;
+	unsigned i, j, s;
+	vaddr_t va;
+
+	for (s=0; s<NUM_KM5_SIZES; s++) {
+		km5_nsecs[num][s] = 0;
+		km5_count[num][s] = 0;
+		for (j=0; j<KM5_NLIVE; j++) {
+			live[j] = 0;
+		}
+		for (i=0; i<KM5_NTRIES; i++) {
+			j = i % KM5_NLIVE;
+			if (live[j] != 0) {
+				free_kpages(live[j]);
+				live[j] = 0;
+			}
+			gettime(&before);
+			va = alloc_kpages(km5_sizes[s]);
+			gettime(&after);
+			if (va == 0) {
+				kprintf("kmalloctest5: thread %lu: "
+					"allocating %u pages failed\n",
+					num, km5_sizes[s]);
+				break;
+			}
+			timespec_sub(&after, &before, &after);
+			km5_nsecs[num][s] += after.tv_sec * 1000000000ULL
+				+ after.tv_nsec;
+			km5_count[num][s]++;
+			/* touch the first and last pages */
+			*(char *)va = (char)i;
+			*(char *)(va + (km5_sizes[s] - 1) * PAGE_SIZE) = (char)i;
+			live[j] = va;
+		}
+		for (j=0; j<KM5_NLIVE; j++) {
+			if (live[j] != 0) {
+				free_kpages(live[j]);
+			}
+		}
+	}
+
+	V(sem);
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned nthreads;
+	unsigned i, s, count;
+	uint64_t nsecs;
+	int result;
+
+	nthreads = NTHREADS;
+	if (nargs > 2) {
+		kprintf("kmalloctest5: usage: km5 [nthreads]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+		if (nthreads < 1 || nthreads > NTHREADS) {
+			kprintf("kmalloctest5: nthreads must be 1-%u\n",
+				NTHREADS);
+			return EINVAL;
+		}
+	}
+
+	kprintf("Starting page allocator latency test (%u threads)...\n",
+		nthreads);
+
+	sem = sem_create("kmalloctest5", 0);
+	if (sem == NULL) {
+		panic("kmalloctest5: sem_create failed\n");
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("kmalloctest5", NULL,
+				     kmalloctest5thread, sem, i);
+		if (result) {
+			panic("kmalloctest5: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	sem_destroy(sem);
+
+	for (s=0; s<NUM_KM5_SIZES; s++) {
+		nsecs = 0;
+		count = 0;
+		for (i=0; i<nthreads; i++) {
+			nsecs += km5_nsecs[i][s];
+			count += km5_count[i][s];
+		}
+		if (count == 0) {
+			kprintf("%2u pages: no successful allocations\n",
+				km5_sizes[s]);
+			continue;
+		}
+		kprintf("%2u pages: %u allocations, average %llu ns\n",
+			km5_sizes[s], count, nsecs / count);
+	}
+
+	kprintf("Page allocator latency test done\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * Object cache test. Makes a cache of odd-sized objects whose
+ * constructor stamps them, and allocates and frees a few slabs' worth
+ * twice over, checking that objects don't overlap and come back still
+ * constructed, and that the second round reuses objects rather than
+ * constructing them all again. Destroying the cache at the end should
+ * run the destructor once for each constructor call.
+ */
+
+#define KM6_SIZE  100
+#define KM6_NOBJS 200
+#define KM6_MAGIC 0x6b6d3621
+
+static unsigned km6_nctors, km6_ndtors;
+
+static
+int
+km6ctor(void *obj)
+{
+	uint32_t *p = obj;
+
+	p[0] = KM6_MAGIC;
+	p[1] = 0;		/* times handed out */
+	km6_nctors++;
+	return 0;
+}
+
+static
+void
+km6dtor(void *obj)
+{
+	uint32_t *p = obj;
+
+	KASSERT(p[0] == KM6_MAGIC);
+	km6_ndtors++;
+}
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct kmem_cache *kc;
+	uint32_t **objs;
+	unsigned pass, i, j, reused = 0;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	km6_nctors = km6_ndtors = 0;
+	objs = kmalloc(KM6_NOBJS * sizeof(*objs));
+	if (objs == NULL) {
+		kprintf("kmalloctest6: out of memory\n");
+		return ENOMEM;
+	}
+	kc = kmem_cache_create("km6", KM6_SIZE, km6ctor, km6dtor);
+	if (kc == NULL) {
+		kprintf("kmalloctest6: out of memory\n");
+		kfree(objs);
+		return ENOMEM;
+	}
+
+	for (pass=0; pass<2 && ok; pass++) {
+		for (i=0; i<KM6_NOBJS; i++) {
+			objs[i] = kmem_cache_alloc(kc);
+			if (objs[i] == NULL) {
+				kprintf("kmalloctest6: out of memory\n");
+				ok = false;
+				break;
+			}
+			if (objs[i][0] != KM6_MAGIC || objs[i][1] > pass) {
+				kprintf("kmalloctest6: object %u not "
+					"constructed\n", i);
+				ok = false;
+			}
+			if (objs[i][1] > 0) {
+				reused++;
+			}
+			objs[i][1]++;
+			for (j=2; j<KM6_SIZE / sizeof(uint32_t); j++) {
+				objs[i][j] = i;
+			}
+		}
+		for (j=0; j<i; j++) {
+			if (objs[j][KM6_SIZE / sizeof(uint32_t) - 1] != j) {
+				kprintf("kmalloctest6: object %u was "
+					"overwritten\n", j);
+				ok = false;
+			}
+		}
+		if (pass == 1) {
+			kmem_cache_printstats();
+		}
+		while (i > 0) {
+			kmem_cache_free(kc, objs[--i]);
+		}
+	}
+
+	kmem_cache_destroy(kc);
+	kfree(objs);
+
+	if (reused == 0) {
+		kprintf("kmalloctest6: no objects were reused\n");
+		ok = false;
+	}
+	if (km6_ndtors != km6_nctors) {
+		kprintf("kmalloctest6: %u constructed but %u destroyed\n",
+			km6_nctors, km6_ndtors);
+		ok = false;
+	}
+
+	kprintf("%u objects constructed, %u reused\n", km6_nctors, reused);
+	kprintf("Object cache test %s\n", ok ? "done" : "FAILED");
+	return ok ? 0 : EINVAL;
+}
+
+////////////////////////////////////////////////////////////
+// km7
+
+/*
+ * Random-order free benchmark. Fills the given number of kernel heap
+ * pages (default KM7_NPAGES) with KM7_SIZE-byte objects, shuffles the
+ * pointers, and times freeing them all in that order, so that each
+ * kfree lands on an arbitrary page. If memory runs out first it goes
+ * ahead with what it got.
+ */
+
+#define KM7_NPAGES 2048
+#define KM7_SIZE   512
+
+int
+kmalloctest7(int nargs, char **args)
+{
+	struct timespec before, after;
+	unsigned npages, nobjs, n, i, j;
+	uint64_t nsecs;
+	void **ptrs, *tmp;
+
+	npages = KM7_NPAGES;
+	if (nargs > 2) {
+		kprintf("kmalloctest7: usage: km7 [npages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		npages = atoi(args[1]);
+		if (npages < 1) {
+			kprintf("kmalloctest7: npages must be positive\n");
+			return EINVAL;
+		}
+	}
+	nobjs = npages * (PAGE_SIZE / KM7_SIZE);
+
+	kprintf("Starting random-order kfree benchmark...\n");
+
+	ptrs = kmalloc(nobjs * sizeof(*ptrs));
+	if (ptrs == NULL) {
+		kprintf("kmalloctest7: out of memory\n");
+		return ENOMEM;
+	}
+
+	for (n=0; n<nobjs; n++) {
+		ptrs[n] = kmalloc(KM7_SIZE);
+		if (ptrs[n] == NULL) {
+			kprintf("kmalloctest7: out of memory after %u "
+				"objects\n", n);
+			break;
+		}
+	}
+
+	/* Fisher-Yates */
+	for (i=n; i>1; i--) {
+		j = random() % i;
+		tmp = ptrs[i - 1];
+		ptrs[i - 1] = ptrs[j];
+		ptrs[j] = tmp;
+	}
+
+	gettime(&before);
+	for (i=0; i<n; i++) {
+		kfree(ptrs[i]);
+	}
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	nsecs = after.tv_sec * 1000000000ULL + after.tv_nsec;
+
+	kfree(ptrs);
+
+	kprintf("%u objects of %u bytes on about %u pages: %llu ns per "
+		"kfree\n", n, KM7_SIZE, n / (PAGE_SIZE / KM7_SIZE),
+		n == 0 ? 0ULL : nsecs / n);
+	kprintf("Random-order kfree benchmark done\n");
+	return 0;
+}
@@ -0,0 +1,839 @@
+/*
+ * Tests and benchmarks for the MY_VM virtual memory system.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <clock.h>
+#include <copyinout.h>
+#include <uio.h>
+#include <proc.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vmstats.h>
+#include <zstore.h>
+#include <pt.h>
+#include <test.h>
+#include "opt-hashpt.h"
+
+////////////////////////////////////////////////////////////
+// common
+
+/*
+ * These tests run in a kernel thread, which belongs to kproc. To get
+ * at a user address space they temporarily install one as kproc's
+ * address space, the same way runprogram does for a new process.
+ */
+
+/* Shape of the "program" the tests build. */
+#define VMT_CODEBASE	0x00400000
+#define VMT_CODEPAGES	32
+#define VMT_DATABASE	0x10000000
+#define VMT_DATAPAGES	64
+#define VMT_STACKPAGES	4
+
+static
+struct addrspace *
+vmt_switchto(struct addrspace *as)
+{
+	struct addrspace *old;
+
+	old = proc_setas(as);
+	if (as != NULL) {
+		as_activate();
+	}
+	else {
+		as_deactivate();
+	}
+	return old;
+}
+
+/*
+ * Write one word into every page of [base, base+npages) in the
+ * current address space.
+ */
+static
+int
+vmt_touch(vaddr_t base, unsigned npages, unsigned val)
+{
+	unsigned i;
+	int result;
+
+	for (i=0; i<npages; i++) {
+		result = copyout(&val, (userptr_t)(base + i * PAGE_SIZE),
+				 sizeof(val));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+vmt_touchall(unsigned val)
+{
+	int result;
+
+	result = vmt_touch(VMT_CODEBASE, VMT_CODEPAGES, val);
+	if (result == 0) {
+		result = vmt_touch(VMT_DATABASE, VMT_DATAPAGES, val);
+	}
+	if (result == 0) {
+		result = vmt_touch(USERSTACK - VMT_STACKPAGES * PAGE_SIZE,
+				   VMT_STACKPAGES, val);
+	}
+	return result;
+}
+
+/*
+ * Make an address space with a code, data and stack region, make it
+ * current, and touch every page of it. (All three are writable, since
+ * the benchmarks write everything.)
+ */
+static
+int
+vmt_setup(struct addrspace **ret)
+{
+	struct addrspace *as;
+	vaddr_t stackptr;
+	int result;
+
+	KASSERT(proc_getas() == NULL);
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = as_define_region(as, VMT_CODEBASE, VMT_CODEPAGES * PAGE_SIZE,
+				  1, 1, 1);
+	if (result == 0) {
+		result = as_define_region(as, VMT_DATABASE,
+					  VMT_DATAPAGES * PAGE_SIZE, 1, 1, 0);
+	}
+	if (result == 0) {
+		result = as_define_stack(as, &stackptr);
+	}
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+
+	vmt_switchto(as);
+	result = vmt_touchall(0);
+	if (result) {
+		vmt_switchto(NULL);
+		as_destroy(as);
+		return result;
+	}
+
+	*ret = as;
+	return 0;
+}
+
+static
+void
+vmt_teardown(struct addrspace *as)
+{
+	vmt_switchto(NULL);
+	as_destroy(as);
+}
+
+static
+uint64_t
+vmt_usecs(const struct timespec *start)
+{
+	struct timespec now;
+
+	gettime(&now);
+	timespec_sub(&now, start, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////
+// fork+exec benchmark
+
+/*
+ * There is no fork or execv system call in this kernel yet, so this
+ * measures their VM half directly: as_copy of a resident program (the
+ * fork) followed by as_destroy of the copy (the child's execv
+ * throwing its image away). With copy-on-write as_copy copies no
+ * pages at all.
+ *
+ * The second pass has the child write every page before it goes
+ * away, which is the worst case for copy-on-write: every page gets
+ * copied after all, as the old eager as_copy always did.
+ */
+
+#define FORKBENCH_NITERS 50
+
+static
+int
+forkbench_pass(struct addrspace *parent, bool dirty, const char *what)
+{
+	struct addrspace *child;
+	struct timespec start;
+	unsigned long copies, shared;
+	uint64_t usecs;
+	unsigned i;
+	int result;
+
+	copies = vmstats_get(VMSTAT_COW_COPIES);
+	shared = vmstats_get(VMSTAT_COW_SHARED);
+	gettime(&start);
+
+	for (i=0; i<FORKBENCH_NITERS; i++) {
+		result = as_copy(parent, &child);
+		if (result) {
+			kprintf("forkbench: as_copy: %s\n", strerror(result));
+			return result;
+		}
+		if (dirty) {
+			vmt_switchto(child);
+			result = vmt_touchall(i);
+			vmt_switchto(parent);
+			if (result) {
+				kprintf("forkbench: touch: %s\n",
+					strerror(result));
+				as_destroy(child);
+				return result;
+			}
+		}
+		as_destroy(child);
+	}
+
+	usecs = vmt_usecs(&start);
+	copies = vmstats_get(VMSTAT_COW_COPIES) - copies;
+	shared = vmstats_get(VMSTAT_COW_SHARED) - shared;
+
+	kprintf("%s: %llu us per iteration, "
+		"%lu pages shared, %lu pages copied per iteration\n",
+		what, usecs / FORKBENCH_NITERS,
+		shared / FORKBENCH_NITERS, copies / FORKBENCH_NITERS);
+	return 0;
+}
+
+int
+forkbench(int nargs, char **args)
+{
+	struct addrspace *parent;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting fork+exec benchmark (%u pages resident)...\n",
+		VMT_CODEPAGES + VMT_DATAPAGES + VMT_STACKPAGES);
+
+	result = vmt_setup(&parent);
+	if (result) {
+		kprintf("forkbench: setup: %s\n", strerror(result));
+		return result;
+	}
+
+	result = forkbench_pass(parent, false, "fork+exec");
+	if (result == 0) {
+		result = forkbench_pass(parent, true, "fork+write all+exit");
+	}
+
+	vmt_teardown(parent);
+
+	kprintf("fork+exec benchmark done\n");
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// mmap test
+
+/*
+ * Map anonymous memory and punch a hole in it; then map a file
+ * shared, change it through the mapping, and check that the changes
+ * reach the file via msync and munmap.
+ */
+
+#define MMT_NPAGES 8
+
+/*
+ * Check that the first word of each of NPAGES pages at BASE is
+ * SALT plus the page number.
+ */
+static
+int
+mmt_check(vaddr_t base, unsigned npages, unsigned salt)
+{
+	unsigned i, val;
+	int result;
+
+	for (i=0; i<npages; i++) {
+		result = copyin((const_userptr_t)(base + i * PAGE_SIZE),
+				&val, sizeof(val));
+		if (result) {
+			return result;
+		}
+		if (val != salt + i) {
+			kprintf("mmaptest: page %u holds %u, expected %u\n",
+				i, val, salt + i);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+static
+int
+mmt_fill(vaddr_t base, unsigned npages, unsigned salt)
+{
+	unsigned i, val;
+	int result;
+
+	for (i=0; i<npages; i++) {
+		val = salt + i;
+		result = copyout(&val, (userptr_t)(base + i * PAGE_SIZE),
+				 sizeof(val));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+mmt_anon(struct addrspace *as)
+{
+	vaddr_t base;
+	unsigned val;
+	int result;
+
+	result = as_mmap(as, MMT_NPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANON, NULL, 0, &base);
+	if (result) {
+		kprintf("mmaptest: as_mmap: %s\n", strerror(result));
+		return result;
+	}
+	result = mmt_fill(base, MMT_NPAGES, 100);
+	if (result == 0) {
+		result = mmt_check(base, MMT_NPAGES, 100);
+	}
+	if (result) {
+		kprintf("mmaptest: anonymous pages: %s\n", strerror(result));
+		return result;
+	}
+
+	/* Unmap pages 3 and 4; the rest should stay. */
+	result = as_munmap(as, base + 3 * PAGE_SIZE, 2 * PAGE_SIZE);
+	if (result) {
+		kprintf("mmaptest: as_munmap: %s\n", strerror(result));
+		return result;
+	}
+	if (copyin((const_userptr_t)(base + 3 * PAGE_SIZE),
+		   &val, sizeof(val)) != EFAULT) {
+		kprintf("mmaptest: unmapped page still accessible\n");
+		return EINVAL;
+	}
+	result = mmt_check(base, 3, 100);
+	if (result == 0) {
+		result = mmt_check(base + 5 * PAGE_SIZE, MMT_NPAGES - 5, 105);
+	}
+	if (result) {
+		kprintf("mmaptest: after hole: %s\n", strerror(result));
+		return result;
+	}
+
+	result = as_munmap(as, base, MMT_NPAGES * PAGE_SIZE);
+	if (result) {
+		kprintf("mmaptest: as_munmap: %s\n", strerror(result));
+		return result;
+	}
+	kprintf("mmaptest: anonymous mapping ok\n");
+	return 0;
+}
+
+/*
+ * Read or write the first word of each page of V.
+ */
+static
+int
+mmt_fileio(struct vnode *v, unsigned salt, bool write)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	unsigned i, val;
+	int result;
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	bzero(buf, PAGE_SIZE);
+
+	result = 0;
+	for (i=0; i<MMT_NPAGES && result == 0; i++) {
+		val = salt + i;
+		memcpy(buf, &val, sizeof(val));
+		uio_kinit(&iov, &ku, buf, PAGE_SIZE, i * PAGE_SIZE,
+			  write ? UIO_WRITE : UIO_READ);
+		result = write ? VOP_WRITE(v, &ku) : VOP_READ(v, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			result = EIO;
+		}
+		if (result == 0 && !write) {
+			memcpy(&val, buf, sizeof(val));
+			if (val != salt + i) {
+				kprintf("mmaptest: file page %u holds %u, "
+					"expected %u\n", i, val, salt + i);
+				result = EINVAL;
+			}
+		}
+	}
+
+	kfree(buf);
+	return result;
+}
+
+static
+int
+mmt_file(struct addrspace *as, const char *path)
+{
+	char name[64];
+	struct vnode *v;
+	unsigned long writes;
+	vaddr_t base;
+	int result;
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(name, path);
+	result = vfs_open(name, O_RDWR | O_CREAT | O_TRUNC, 0664, &v);
+	if (result) {
+		kprintf("mmaptest: %s: %s\n", path, strerror(result));
+		return result;
+	}
+
+	result = mmt_fileio(v, 200, true);
+	if (result) {
+		kprintf("mmaptest: writing %s: %s\n", path, strerror(result));
+		vfs_close(v);
+		return result;
+	}
+
+	result = as_mmap(as, MMT_NPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, v, 0, &base);
+	if (result) {
+		kprintf("mmaptest: as_mmap: %s\n", strerror(result));
+		vfs_close(v);
+		return result;
+	}
+
+	writes = vmstats_get(VMSTAT_FILEWRITES);
+	result = mmt_check(base, MMT_NPAGES, 200);
+	if (result == 0) {
+		result = mmt_fill(base, MMT_NPAGES, 300);
+	}
+	if (result == 0) {
+		/* Half goes back with msync, the rest with munmap. */
+		result = as_msync(as, base, MMT_NPAGES / 2 * PAGE_SIZE);
+	}
+	if (as_munmap(as, base, MMT_NPAGES * PAGE_SIZE) && result == 0) {
+		result = EINVAL;
+	}
+	if (result == 0) {
+		result = mmt_fileio(v, 300, false);
+	}
+	vfs_close(v);
+	if (result) {
+		kprintf("mmaptest: file mapping: %s\n", strerror(result));
+		return result;
+	}
+
+	kprintf("mmaptest: shared file mapping ok, %lu pages written back\n",
+		vmstats_get(VMSTAT_FILEWRITES) - writes);
+	return 0;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	struct addrspace *as;
+	const char *path;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: mmt [file]\n");
+		return EINVAL;
+	}
+	path = nargs == 2 ? args[1] : "emu0:mmaptest.tmp";
+	if (strlen(path) >= 64) {
+		return ENAMETOOLONG;
+	}
+
+	kprintf("Starting mmap test...\n");
+
+	result = vmt_setup(&as);
+	if (result) {
+		kprintf("mmaptest: setup: %s\n", strerror(result));
+		return result;
+	}
+
+	result = mmt_anon(as);
+	if (result == 0) {
+		result = mmt_file(as, path);
+	}
+
+	vmt_teardown(as);
+
+	kprintf("mmap test %s\n", result ? "failed" : "done");
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// fault-around benchmark
+
+/*
+ * Read one word from every page of a 1M anonymous mapping, in order
+ * and in a random order, with each fault-around window in turn, and
+ * report the faults taken and the time per page. Everything is
+ * resident, so the faults are TLB misses only. The UTLB refill fast
+ * path would take all of those without calling vm_fault, so it is
+ * turned off for the run.
+ */
+
+#define FAB_NPAGES	256
+#define FAB_NPASSES	8
+
+static const unsigned fab_windows[] = { 1, 2, 4, 8, 16 };
+
+static
+int
+fab_pass(vaddr_t base, const unsigned *order, const char *what)
+{
+	struct timespec start;
+	unsigned long faults;
+	uint64_t usecs;
+	unsigned i, j, val;
+	int result;
+
+	faults = vmstats_get(VMSTAT_FAULTS);
+	gettime(&start);
+
+	for (j=0; j<FAB_NPASSES; j++) {
+		vm_tlb_flush();
+		for (i=0; i<FAB_NPAGES; i++) {
+			result = copyin((const_userptr_t)
+					(base + order[i] * PAGE_SIZE),
+					&val, sizeof(val));
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	usecs = vmt_usecs(&start);
+	faults = vmstats_get(VMSTAT_FAULTS) - faults;
+
+	kprintf("  %-10s %4lu faults/pass, %llu ns/page\n", what,
+		faults / FAB_NPASSES,
+		usecs * 1000 / (FAB_NPASSES * FAB_NPAGES));
+	return 0;
+}
+
+int
+faultaroundbench(int nargs, char **args)
+{
+	struct addrspace *as;
+	unsigned *seq, *rnd;
+	unsigned oldwindow, i, j, tmp, seed;
+	bool oldfast;
+	vaddr_t base;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	seq = kmalloc(FAB_NPAGES * sizeof(unsigned));
+	rnd = kmalloc(FAB_NPAGES * sizeof(unsigned));
+	if (seq == NULL || rnd == NULL) {
+		kfree(seq);
+		kfree(rnd);
+		return ENOMEM;
+	}
+
+	/* A fixed shuffle, so that runs are comparable. */
+	seed = 1;
+	for (i=0; i<FAB_NPAGES; i++) {
+		seq[i] = rnd[i] = i;
+	}
+	for (i=FAB_NPAGES-1; i>0; i--) {
+		seed = seed * 1103515245 + 12345;
+		j = (seed >> 16) % (i + 1);
+		tmp = rnd[i];
+		rnd[i] = rnd[j];
+		rnd[j] = tmp;
+	}
+
+	kprintf("Starting fault-around benchmark (%u pages)...\n",
+		FAB_NPAGES);
+
+	oldfast = vm_tlb_getfastrefill();
+	vm_tlb_setfastrefill(false);
+
+	result = vmt_setup(&as);
+	if (result) {
+		kprintf("faultaroundbench: setup: %s\n", strerror(result));
+		vm_tlb_setfastrefill(oldfast);
+		kfree(seq);
+		kfree(rnd);
+		return result;
+	}
+
+	result = as_mmap(as, FAB_NPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANON, NULL, 0, &base);
+	if (result == 0) {
+		result = vmt_touch(base, FAB_NPAGES, 0);
+	}
+
+	oldwindow = vm_getfaultaround();
+	for (i=0; result == 0 && i<sizeof(fab_windows)/sizeof(fab_windows[0]);
+	     i++) {
+		vm_setfaultaround(fab_windows[i]);
+		kprintf("Window %u:\n", fab_windows[i]);
+		result = fab_pass(base, seq, "sequential");
+		if (result == 0) {
+			result = fab_pass(base, rnd, "random");
+		}
+	}
+	vm_setfaultaround(oldwindow);
+
+	if (result) {
+		kprintf("faultaroundbench: %s\n", strerror(result));
+	}
+
+	vmt_teardown(as);
+	vm_tlb_setfastrefill(oldfast);
+	kfree(seq);
+	kfree(rnd);
+
+	kprintf("fault-around benchmark done\n");
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// page table benchmark
+
+/*
+ * ptbench: build many small address spaces, then a few large ones,
+ * all alive at once, touching every page of each; report the page
+ * table memory they take and the average time per page fault. Run it
+ * on kernels with and without options hashpt to compare the two page
+ * table formats.
+ *
+ * The small ones look like a tiny program: a couple of pages each of
+ * code, data and stack, in three different 4M slices of the address
+ * space.
+ */
+
+#define PTB_NSMALL	32
+#define PTB_SMALLPAGES	2
+#define PTB_NLARGE	2
+#define PTB_LARGEPAGES	128
+
+static
+int
+ptb_pass(const char *what, unsigned nas, unsigned npages)
+{
+	struct addrspace *as[PTB_NSMALL];
+	struct timespec start;
+	vaddr_t stackptr;
+	size_t ptbytes;
+	unsigned long faults;
+	uint64_t usecs = 0;
+	unsigned i, n;
+	int result = 0;
+
+	KASSERT(nas <= PTB_NSMALL);
+
+	ptbytes = pt_memory();
+	faults = vmstats_get(VMSTAT_FAULTS);
+
+	for (n=0; n<nas; n++) {
+		as[n] = as_create();
+		if (as[n] == NULL) {
+			result = ENOMEM;
+			break;
+		}
+		result = as_define_region(as[n], VMT_CODEBASE,
+					  npages * PAGE_SIZE, 1, 1, 1);
+		if (result == 0) {
+			result = as_define_region(as[n], VMT_DATABASE,
+						  npages * PAGE_SIZE, 1, 1, 0);
+		}
+		if (result == 0) {
+			result = as_define_stack(as[n], &stackptr);
+		}
+		if (result == 0) {
+			vmt_switchto(as[n]);
+			gettime(&start);
+			result = vmt_touch(VMT_CODEBASE, npages, n);
+			if (result == 0) {
+				result = vmt_touch(VMT_DATABASE, npages, n);
+			}
+			if (result == 0) {
+				result = vmt_touch(USERSTACK - PAGE_SIZE, 1, n);
+			}
+			usecs += vmt_usecs(&start);
+			vmt_switchto(NULL);
+		}
+		if (result) {
+			as_destroy(as[n]);
+			break;
+		}
+	}
+
+	if (result == 0) {
+		ptbytes = pt_memory() - ptbytes;
+		faults = vmstats_get(VMSTAT_FAULTS) - faults;
+		kprintf("%s: %u address spaces of %u pages: %lu bytes of "
+			"page tables (%lu each), %llu ns per fault\n",
+			what, nas, 2 * npages + 1, (unsigned long)ptbytes,
+			(unsigned long)ptbytes / nas,
+			faults == 0 ? 0ULL : usecs * 1000 / faults);
+	}
+	else {
+		kprintf("ptbench: %s: %s\n", what, strerror(result));
+	}
+
+	for (i=0; i<n; i++) {
+		as_destroy(as[i]);
+	}
+	return result;
+}
+
+int
+ptbench(int nargs, char **args)
+{
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page table benchmark (%s page tables)...\n",
+		OPT_HASHPT ? "hashed" : "two-level");
+
+	result = ptb_pass("small", PTB_NSMALL, PTB_SMALLPAGES);
+	if (result == 0) {
+		result = ptb_pass("large", PTB_NLARGE, PTB_LARGEPAGES);
+	}
+
+	kprintf("page table benchmark done\n");
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// compressed store
+
+/*
+ * zstoretest: push pages of various kinds through the compressed
+ * store and check that they come back intact, or are refused if
+ * they don't compress.
+ */
+
+#define ZST_NKINDS 4
+
+static const char *const zst_kinds[ZST_NKINDS] = {
+	"zero", "pattern", "text", "random",
+};
+
+static
+void
+zst_fill(unsigned char *p, unsigned kind)
+{
+	static const char words[] = "the quick brown fox jumps over ";
+	uint32_t seed = 1;
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		switch (kind) {
+		    case 0: p[i] = 0; break;
+		    case 1: p[i] = i % 7 == 0 ? i / 7 : 0; break;
+		    case 2: p[i] = words[(i * 5 / 4) % (sizeof(words) - 1)]; break;
+		    default:
+			seed = seed * 1103515245 + 12345;
+			p[i] = seed >> 16;
+			break;
+		}
+	}
+}
+
+int
+zstoretest(int nargs, char **args)
+{
+	unsigned char *page, *copy;
+	unsigned kind, i, slot;
+	int result, ret = 0;
+
+	(void)nargs;
+	(void)args;
+
+	page = (unsigned char *)alloc_kpages(1);
+	copy = kmalloc(PAGE_SIZE);
+	if (page == NULL || copy == NULL) {
+		if (page != NULL) {
+			free_kpages((vaddr_t)page);
+		}
+		kfree(copy);
+		return ENOMEM;
+	}
+
+	for (kind = 0; kind < ZST_NKINDS; kind++) {
+		zst_fill(page, kind);
+		memcpy(copy, page, PAGE_SIZE);
+
+		result = zstore_out(KVADDR_TO_PADDR((vaddr_t)page), &slot);
+		if (result) {
+			kprintf("zstoretest: %s page: %s\n", zst_kinds[kind],
+				strerror(result));
+			if (kind != ZST_NKINDS - 1 || result != E2BIG) {
+				ret = result;
+			}
+			continue;
+		}
+		if (kind == ZST_NKINDS - 1) {
+			/* It should have been refused with E2BIG. */
+			kprintf("zstoretest: random page was compressed\n");
+			ret = EINVAL;
+		}
+
+		memset(page, 0xa5, PAGE_SIZE);
+		result = zstore_in(KVADDR_TO_PADDR((vaddr_t)page), slot);
+		zstore_free(slot);
+		if (result) {
+			kprintf("zstoretest: %s page: zstore_in: %s\n",
+				zst_kinds[kind], strerror(result));
+			ret = result;
+			continue;
+		}
+		for (i=0; i<PAGE_SIZE; i++) {
+			if (page[i] != copy[i]) {
+				kprintf("zstoretest: %s page: byte %u is %u, "
+					"expected %u\n", zst_kinds[kind], i,
+					page[i], copy[i]);
+				ret = EINVAL;
+				break;
+			}
+		}
+		if (i == PAGE_SIZE) {
+			kprintf("zstoretest: %s page ok\n", zst_kinds[kind]);
+		}
+	}
+
+	free_kpages((vaddr_t)page);
+	kfree(copy);
+
+	zstore_printstats();
+	kprintf("zstoretest %s\n", ret == 0 ? "done" : "FAILED");
+	return ret;
+}
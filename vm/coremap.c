@@ -0,0 +1,983 @@
+/*
+ * Coremap and buddy allocator for physical page frames. See coremap.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <platform/maxcpus.h>
+#include <vm.h>
+#include <coremap.h>
+
+/* Frame states */
+#define CM_FIXED	0	/* in use before bootstrap; never freed */
+#define CM_ALLOC	1	/* allocated */
+#define CM_FREE		2	/* free, inside a larger free block */
+#define CM_FREEHEAD	3	/* free, first frame of a free block */
+#define CM_CACHED	4	/* free, in some cpu's page cache */
+
+/* Frames moved between a cpu's page cache and the free lists at once. */
+#define CM_BATCH	(CPU_PAGECACHE_MAX / 2)
+
+#define CM_NONE		((unsigned)-1)	/* end of a free list */
+
+struct coremap_entry {
+	uint8_t cme_state;		/* one of the states above */
+	uint8_t cme_order;		/* CM_FREEHEAD: order of the block */
+	unsigned cme_npages;		/* CM_ALLOC: size, on the first frame */
+	unsigned cme_refcount;		/* CM_ALLOC: mappings of a user page */
+	struct addrspace *cme_as;	/* CM_ALLOC: sole user mapping, */
+	vaddr_t cme_vaddr;		/*   if any (reverse map) */
+	uint8_t cme_busy;		/* being paged out */
+	unsigned cme_pincount;		/* not to be paged out while > 0 */
+	unsigned cme_sharers;		/* CM_ALLOC: shared: known mappings */
+	unsigned cme_next;		/* CM_FREEHEAD: free list links */
+	unsigned cme_prev;
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * The per-frame fields of allocated frames (reference count, owner,
+ * pin count and busy mark) are protected by one of a set of spinlocks
+ * picked by frame number, not by coremap_lock, so that faulting,
+ * sharing and freeing user pages doesn't serialize every cpu on the
+ * global lock; that is only for the free lists and the clock hands.
+ * coremap_lock, where both are needed, comes first. Waiting for a
+ * busy frame goes through the wait channel of its lock.
+ */
+#define CM_NFRAMELOCKS	64
+#define CM_FRAMELOCK(idx) (&cm_framelocks[(idx) % CM_NFRAMELOCKS])
+#define CM_WCHAN(idx)	(cm_wchans[(idx) % CM_NFRAMELOCKS])
+static struct spinlock cm_framelocks[CM_NFRAMELOCKS];
+static struct wchan *cm_wchans[CM_NFRAMELOCKS];
+
+static struct coremap_entry *coremap;
+
+/*
+ * Reverse map for shared user pages. A frame mapped by several
+ * address spaces has no owner, but as many of its mappings as we
+ * could record are kept on a list of sharers (linked by index from
+ * cme_sharers, under the frame's lock), so that when all but one of
+ * them are gone the last one becomes the owner again and the page can
+ * be paged out or merged. The records come from a fixed pool, one
+ * per frame, so they can be had without sleeping; if it runs out a
+ * mapping simply goes unrecorded, and that frame won't get its owner
+ * back. References that aren't mappings (the page cache's, or page
+ * merging's own) aren't recorded either, which is fine: the owner is
+ * only restored when one reference is left and it is a recorded
+ * mapping.
+ */
+struct cm_sharer {
+	struct addrspace *cs_as;
+	vaddr_t cs_vaddr;
+	unsigned cs_next;
+};
+
+static struct spinlock cm_sharerlock = SPINLOCK_INITIALIZER;
+static struct cm_sharer *cm_sharers;
+static unsigned cm_freesharers;		/* pool free list */
+
+/*
+ * Reference bits for the clock, one byte per frame (nonzero: used
+ * since the clock last looked), kept apart from the coremap so that
+ * the UTLB refill handler in exception-mips1.S can set them with a
+ * single store, indexed by physical frame number. They are only
+ * hints, so nobody locks them.
+ */
+uint8_t *coremap_refbits;
+static unsigned cm_nframes;		/* frames in RAM */
+static unsigned cm_base;		/* first frame we manage */
+static unsigned cm_nfree;		/* frames currently free */
+static unsigned cm_freelist[CM_MAXORDER + 1];
+static unsigned cm_hand;		/* clock hand for page replacement */
+static unsigned cm_mergehand;		/* hand for coremap_pickmerge */
+static bool cm_active = false;
+
+/* Cpus that have page caches, for counting the frames in them. */
+static struct cpu *cm_cpus[MAXCPUS];
+
+////////////////////////////////////////////////////////////
+// free lists
+
+static
+void
+cm_list_insert(unsigned idx, unsigned order)
+{
+	coremap[idx].cme_state = CM_FREEHEAD;
+	coremap[idx].cme_order = order;
+	coremap[idx].cme_prev = CM_NONE;
+	coremap[idx].cme_next = cm_freelist[order];
+	if (cm_freelist[order] != CM_NONE) {
+		coremap[cm_freelist[order]].cme_prev = idx;
+	}
+	cm_freelist[order] = idx;
+}
+
+static
+void
+cm_list_remove(unsigned idx)
+{
+	struct coremap_entry *cme = &coremap[idx];
+
+	KASSERT(cme->cme_state == CM_FREEHEAD);
+
+	if (cme->cme_prev != CM_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		cm_freelist[cme->cme_order] = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_state = CM_FREE;
+}
+
+/*
+ * Put the free block of 2^ORDER frames at IDX on the free lists,
+ * merging it with its buddy as many times as possible.
+ */
+static
+void
+cm_freeblock(unsigned idx, unsigned order)
+{
+	unsigned buddy;
+
+	while (order < CM_MAXORDER) {
+		buddy = idx ^ (1U << order);
+		if (buddy >= cm_nframes ||
+		    coremap[buddy].cme_state != CM_FREEHEAD ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		cm_list_remove(buddy);
+		if (buddy < idx) {
+			idx = buddy;
+		}
+		order++;
+	}
+	cm_list_insert(idx, order);
+}
+
+/*
+ * Free an arbitrary run of frames by cutting it into the largest
+ * aligned blocks it contains.
+ */
+static
+void
+cm_freerange(unsigned idx, unsigned npages)
+{
+	unsigned i, order;
+
+	for (i=0; i<npages; i++) {
+		coremap[idx + i].cme_state = CM_FREE;
+		coremap[idx + i].cme_npages = 0;
+	}
+	cm_nfree += npages;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       (idx & (1U << order)) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		cm_freeblock(idx, order);
+		idx += 1U << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Take a block of 2^ORDER frames off the free lists, splitting a
+ * larger one if needed. Returns CM_NONE if there is none.
+ */
+static
+unsigned
+cm_allocblock(unsigned order)
+{
+	unsigned o, idx;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (o = order; o <= CM_MAXORDER; o++) {
+		if (cm_freelist[o] != CM_NONE) {
+			break;
+		}
+	}
+	if (o > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	idx = cm_freelist[o];
+	cm_list_remove(idx);
+
+	/* Split down to the order we need. */
+	while (o > order) {
+		o--;
+		cm_list_insert(idx + (1U << o), o);
+	}
+	cm_nfree -= 1U << order;
+	return idx;
+}
+
+////////////////////////////////////////////////////////////
+// bootstrap
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t firstpaddr, cmpaddr;
+	unsigned long cmpages;
+	unsigned i;
+
+	cm_nframes = ram_getsize() / PAGE_SIZE;
+	cmpages = DIVROUNDUP(cm_nframes * (sizeof(struct coremap_entry) +
+					   sizeof(struct cm_sharer)) +
+			     cm_nframes, PAGE_SIZE);
+	cmpaddr = ram_stealmem(cmpages);
+	if (cmpaddr == 0) {
+		panic("coremap: cannot allocate %lu pages\n", cmpages);
+	}
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(cmpaddr);
+	cm_sharers = (struct cm_sharer *)(coremap + cm_nframes);
+	coremap_refbits = (uint8_t *)(cm_sharers + cm_nframes);
+
+	firstpaddr = ram_getfirstfree();
+	cm_base = firstpaddr / PAGE_SIZE;
+
+	for (i=0; i<cm_nframes; i++) {
+		coremap[i].cme_state = CM_FIXED;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_busy = 0;
+		coremap_refbits[i] = 0;
+		coremap[i].cme_pincount = 0;
+		coremap[i].cme_sharers = CM_NONE;
+		cm_sharers[i].cs_next = i + 1 < cm_nframes ? i + 1 : CM_NONE;
+		coremap[i].cme_next = CM_NONE;
+		coremap[i].cme_prev = CM_NONE;
+	}
+	cm_freesharers = 0;
+	for (i=0; i<=CM_MAXORDER; i++) {
+		cm_freelist[i] = CM_NONE;
+	}
+	for (i=0; i<CM_NFRAMELOCKS; i++) {
+		spinlock_init(&cm_framelocks[i]);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_nfree = 0;
+	cm_freerange(cm_base, cm_nframes - cm_base);
+	cm_hand = cm_base;
+	cm_active = true;
+	spinlock_release(&coremap_lock);
+
+	for (i=0; i<CM_NFRAMELOCKS; i++) {
+		cm_wchans[i] = wchan_create("coremap");
+		if (cm_wchans[i] == NULL) {
+			panic("coremap: wchan_create failed\n");
+		}
+	}
+
+	kprintf("coremap: %u frames, %u free\n", cm_nframes, cm_nfree);
+}
+
+bool
+coremap_active(void)
+{
+	return cm_active;
+}
+
+unsigned
+coremap_nframes(void)
+{
+	return cm_nframes - cm_base;
+}
+
+/*
+ * Free frames, including those sitting in the cpus' page caches.
+ * The caches are counted without their owners' cooperation, so the
+ * total is only a hint (which is all the pageout daemon needs).
+ */
+unsigned
+coremap_nfree(void)
+{
+	unsigned n, i;
+
+	n = cm_nfree;
+	for (i=0; i<MAXCPUS; i++) {
+		if (cm_cpus[i] != NULL) {
+			n += cm_cpus[i]->c_npagecache;
+		}
+	}
+	return n;
+}
+
+////////////////////////////////////////////////////////////
+// per-cpu page caches
+
+/*
+ * Move up to CM_BATCH single frames from the free lists into cpu
+ * C's page cache. Called with its c_pagecache_lock held.
+ */
+static
+void
+cm_refill(struct cpu *c)
+{
+	unsigned idx;
+
+	KASSERT(spinlock_do_i_hold(&c->c_pagecache_lock));
+
+	spinlock_acquire(&coremap_lock);
+	while (c->c_npagecache < CM_BATCH) {
+		idx = cm_allocblock(0);
+		if (idx == CM_NONE) {
+			break;
+		}
+		coremap[idx].cme_state = CM_CACHED;
+		c->c_pagecache[c->c_npagecache++] = (paddr_t)idx * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Give CM_BATCH frames from cpu C's page cache back to the free
+ * lists. Called with its c_pagecache_lock held.
+ */
+static
+void
+cm_drain(struct cpu *c)
+{
+	unsigned idx, i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_pagecache_lock));
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<CM_BATCH && c->c_npagecache > 0; i++) {
+		idx = c->c_pagecache[--c->c_npagecache] / PAGE_SIZE;
+		KASSERT(coremap[idx].cme_state == CM_CACHED);
+		cm_freerange(idx, 1);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Single-frame allocation. The frame is taken from this cpu's cache
+ * without touching coremap_lock unless the cache is empty. Frames in
+ * a cache belong to that cpu alone, so their entries can be updated
+ * without the lock: the buddy code only ever looks for CM_FREEHEAD.
+ */
+static
+paddr_t
+cm_alloc_one(void)
+{
+	struct cpu *c;
+	paddr_t paddr;
+	unsigned idx;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	cm_cpus[c->c_number] = c;
+	spinlock_acquire(&c->c_pagecache_lock);
+	if (c->c_npagecache == 0) {
+		cm_refill(c);
+	}
+	if (c->c_npagecache == 0) {
+		spinlock_release(&c->c_pagecache_lock);
+		splx(spl);
+		return 0;
+	}
+	paddr = c->c_pagecache[--c->c_npagecache];
+	spinlock_release(&c->c_pagecache_lock);
+	splx(spl);
+
+	idx = paddr / PAGE_SIZE;
+	KASSERT(coremap[idx].cme_state == CM_CACHED);
+	coremap[idx].cme_state = CM_ALLOC;
+	coremap[idx].cme_npages = 1;
+	coremap[idx].cme_refcount = 1;
+	coremap[idx].cme_as = NULL;
+	return paddr;
+}
+
+static
+void
+cm_free_one(unsigned idx)
+{
+	struct cpu *c;
+	int spl;
+
+	KASSERT(coremap[idx].cme_state == CM_ALLOC);
+	coremap[idx].cme_state = CM_CACHED;
+	coremap[idx].cme_npages = 0;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	cm_cpus[c->c_number] = c;
+	spinlock_acquire(&c->c_pagecache_lock);
+	if (c->c_npagecache == CPU_PAGECACHE_MAX) {
+		cm_drain(c);
+	}
+	c->c_pagecache[c->c_npagecache++] = (paddr_t)idx * PAGE_SIZE;
+	spinlock_release(&c->c_pagecache_lock);
+	splx(spl);
+}
+
+/*
+ * Give every frame in every cpu's page cache back to the free lists,
+ * where they can merge into larger blocks again. For multi-page
+ * allocations that come up short.
+ */
+static
+void
+cm_drainall(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		c = cm_cpus[i];
+		if (c == NULL) {
+			continue;
+		}
+		spinlock_acquire(&c->c_pagecache_lock);
+		while (c->c_npagecache > 0) {
+			cm_drain(c);
+		}
+		spinlock_release(&c->c_pagecache_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned order, idx, i;
+
+	KASSERT(cm_active);
+
+	if (npages == 0) {
+		return 0;
+	}
+	if (npages == 1) {
+		return cm_alloc_one();
+	}
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+		if (order > CM_MAXORDER) {
+			return 0;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	idx = cm_allocblock(order);
+	if (idx == CM_NONE) {
+		/* The frames the cpus are holding might complete a block. */
+		spinlock_release(&coremap_lock);
+		cm_drainall();
+		spinlock_acquire(&coremap_lock);
+		idx = cm_allocblock(order);
+	}
+	if (idx == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	for (i=0; i<npages; i++) {
+		coremap[idx + i].cme_state = CM_ALLOC;
+	}
+	coremap[idx].cme_npages = npages;
+	coremap[idx].cme_refcount = 1;
+	coremap[idx].cme_as = NULL;
+
+	/* Give back the part of the block we were not asked for. */
+	cm_freerange(idx + npages, (1U << order) - npages);
+
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)idx * PAGE_SIZE;
+}
+
+void
+coremap_free(paddr_t paddr, unsigned long npages)
+{
+	unsigned idx, i;
+
+	KASSERT(cm_active);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	idx = paddr / PAGE_SIZE;
+	KASSERT(idx < cm_nframes);
+
+	/*
+	 * The caller owns the frames being freed, so their entries
+	 * can be looked at without the lock.
+	 */
+	if (coremap[idx].cme_state == CM_FIXED) {
+		/* Allocated before we took over; nothing to give back. */
+		return;
+	}
+
+	if (npages == 0) {
+		npages = coremap[idx].cme_npages;
+		KASSERT(npages > 0);
+	}
+	if (npages == 1) {
+		cm_free_one(idx);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(idx + npages <= cm_nframes);
+	for (i=0; i<npages; i++) {
+		KASSERT(coremap[idx + i].cme_state == CM_ALLOC);
+	}
+
+	cm_freerange(idx, npages);
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Add AS's mapping at VADDR to the sharers of frame IDX, if there's
+ * a record to spare. Called with the frame's lock held.
+ */
+static
+void
+cm_addsharer(unsigned idx, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned sh;
+
+	KASSERT(spinlock_do_i_hold(CM_FRAMELOCK(idx)));
+
+	spinlock_acquire(&cm_sharerlock);
+	sh = cm_freesharers;
+	if (sh != CM_NONE) {
+		cm_freesharers = cm_sharers[sh].cs_next;
+	}
+	spinlock_release(&cm_sharerlock);
+	if (sh == CM_NONE) {
+		return;
+	}
+
+	cm_sharers[sh].cs_as = as;
+	cm_sharers[sh].cs_vaddr = vaddr;
+	cm_sharers[sh].cs_next = coremap[idx].cme_sharers;
+	coremap[idx].cme_sharers = sh;
+}
+
+/*
+ * Drop AS's mapping at VADDR from the sharers of frame IDX, or with
+ * AS == NULL all of them. Called with the frame's lock held.
+ */
+static
+void
+cm_removesharers(unsigned idx, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned *shp, sh;
+
+	KASSERT(spinlock_do_i_hold(CM_FRAMELOCK(idx)));
+
+	shp = &coremap[idx].cme_sharers;
+	while ((sh = *shp) != CM_NONE) {
+		if (as != NULL && (cm_sharers[sh].cs_as != as ||
+				   cm_sharers[sh].cs_vaddr != vaddr)) {
+			shp = &cm_sharers[sh].cs_next;
+			continue;
+		}
+		*shp = cm_sharers[sh].cs_next;
+		spinlock_acquire(&cm_sharerlock);
+		cm_sharers[sh].cs_next = cm_freesharers;
+		cm_freesharers = sh;
+		spinlock_release(&cm_sharerlock);
+	}
+}
+
+/*
+ * Reference counts for frames mapped by more than one address space
+ * (copy-on-write after as_copy, or merged pages), or held by the page
+ * cache. A frame starts with one reference when allocated;
+ * coremap_decref frees it when the last one goes.
+ *
+ * A shared frame has no owner in the reverse map, so it is never
+ * chosen for page-out or merging. Its owner and any new mapping (AS
+ * at VADDR; AS is NULL for a reference that isn't a user mapping)
+ * are recorded as sharers, and when the count comes back down to one
+ * and that one is a recorded sharer, it becomes the owner again.
+ * Mappings must be taken off the list with coremap_clearowner before
+ * their reference is dropped.
+ */
+void
+coremap_incref(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+	struct coremap_entry *cme;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	cme = &coremap[idx];
+	KASSERT(cme->cme_state == CM_ALLOC);
+	KASSERT(cme->cme_refcount > 0);
+	cme->cme_refcount++;
+	if (cme->cme_as != NULL) {
+		cm_addsharer(idx, cme->cme_as, cme->cme_vaddr);
+		cme->cme_as = NULL;
+	}
+	if (as != NULL) {
+		cm_addsharer(idx, as, vaddr);
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+}
+
+void
+coremap_decref(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+	struct coremap_entry *cme;
+	unsigned refcount, sh;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	cme = &coremap[idx];
+	KASSERT(cme->cme_state == CM_ALLOC);
+	KASSERT(cme->cme_refcount > 0);
+	refcount = --cme->cme_refcount;
+	sh = cme->cme_sharers;
+	if (refcount == 1 && sh != CM_NONE &&
+	    cm_sharers[sh].cs_next == CM_NONE) {
+		/* The one reference left is this mapping: unshared. */
+		KASSERT(cme->cme_as == NULL);
+		cme->cme_as = cm_sharers[sh].cs_as;
+		cme->cme_vaddr = cm_sharers[sh].cs_vaddr;
+		coremap_refbits[idx] = 1;
+		cm_removesharers(idx, NULL, 0);
+	}
+	else if (refcount == 0) {
+		cm_removesharers(idx, NULL, 0);
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+
+	/* Only the last reference goes anywhere near coremap_lock. */
+	if (refcount == 0) {
+		coremap_free(paddr, 1);
+	}
+}
+
+unsigned
+coremap_getref(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+	unsigned refcount;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	refcount = coremap[idx].cme_refcount;
+	spinlock_release(CM_FRAMELOCK(idx));
+
+	return refcount;
+}
+
+////////////////////////////////////////////////////////////
+// reverse map and page replacement
+
+/*
+ * Record that the frame at PADDR is mapped at VADDR by AS and
+ * nowhere else (forgetting any sharers), or with AS == NULL that it
+ * no longer has a single user owner. Only frames with an owner are
+ * candidates for coremap_pickvictim.
+ */
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	KASSERT(coremap[idx].cme_state == CM_ALLOC);
+	coremap[idx].cme_as = as;
+	coremap[idx].cme_vaddr = vaddr;
+	coremap_refbits[idx] = 1;
+	if (as != NULL) {
+		cm_removesharers(idx, NULL, 0);
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+}
+
+/*
+ * Take the frame at PADDR away from its owner, or from its sharers
+ * AS's mapping at VADDR, for tearing down that mapping. Fails,
+ * returning false, if the frame is busy being paged out; the caller
+ * should coremap_waitbusy and look again.
+ */
+bool
+coremap_clearowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+	bool ok;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	ok = !coremap[idx].cme_busy;
+	if (ok) {
+		coremap[idx].cme_as = NULL;
+		cm_removesharers(idx, as, vaddr);
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+
+	return ok;
+}
+
+/*
+ * Pin the frame at PADDR so that coremap_pickvictim leaves it alone,
+ * e.g. while it is being written back to a file. Fails, returning
+ * false, if it is already busy being paged out; the caller should
+ * coremap_waitbusy and look again. Pins nest.
+ */
+bool
+coremap_pin(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+	bool ok;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	KASSERT(coremap[idx].cme_state == CM_ALLOC);
+	ok = !coremap[idx].cme_busy;
+	if (ok) {
+		coremap[idx].cme_pincount++;
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+
+	return ok;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	KASSERT(coremap[idx].cme_pincount > 0);
+	coremap[idx].cme_pincount--;
+	spinlock_release(CM_FRAMELOCK(idx));
+}
+
+/*
+ * Note that the page in the frame at PADDR has just been used. This
+ * is only a hint for the clock, so no lock is taken. (Misses taken
+ * by the UTLB fast path set the bit themselves.)
+ */
+void
+coremap_touch(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+
+	KASSERT(idx < cm_nframes);
+	coremap_refbits[idx] = 1;
+}
+
+/*
+ * True if the frame is an unshared user page with an owner that
+ * nobody else is working on, which may be marked busy for paging it
+ * out or merging it.
+ */
+static
+bool
+cm_ownedidle(struct coremap_entry *cme)
+{
+	return cme->cme_state == CM_ALLOC && cme->cme_as != NULL &&
+		!cme->cme_busy && cme->cme_pincount == 0 &&
+		cme->cme_refcount == 1;
+}
+
+/*
+ * Clock replacement. Sweep the frames from where the hand stopped
+ * last time, giving pages used since the previous sweep a second
+ * chance, and return the first unshared, unpinned, unbusy user page
+ * that has not been used, marked busy. Its owner and address are
+ * returned in AS_RET and VADDR_RET. At most MAXSCAN frames are looked
+ * at, and never more than two full sweeps' worth; the number actually
+ * looked at is returned in SCANNED. Returns 0 if nothing was found.
+ */
+paddr_t
+coremap_pickvictim(unsigned maxscan, unsigned *scanned,
+		   struct addrspace **as_ret, vaddr_t *vaddr_ret)
+{
+	struct coremap_entry *cme;
+	unsigned n, idx;
+
+	/* Two sweeps: the first may only be clearing reference bits. */
+	if (maxscan > 2 * (cm_nframes - cm_base)) {
+		maxscan = 2 * (cm_nframes - cm_base);
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	for (n = 0; n < maxscan; n++) {
+		idx = cm_hand;
+		cm_hand++;
+		if (cm_hand == cm_nframes) {
+			cm_hand = cm_base;
+		}
+
+		cme = &coremap[idx];
+		spinlock_acquire(CM_FRAMELOCK(idx));
+		if (!cm_ownedidle(cme)) {
+			spinlock_release(CM_FRAMELOCK(idx));
+			continue;
+		}
+		if (coremap_refbits[idx]) {
+			coremap_refbits[idx] = 0;
+			spinlock_release(CM_FRAMELOCK(idx));
+			continue;
+		}
+
+		cme->cme_busy = 1;
+		*as_ret = cme->cme_as;
+		*vaddr_ret = cme->cme_vaddr;
+		spinlock_release(CM_FRAMELOCK(idx));
+		spinlock_release(&coremap_lock);
+		*scanned = n + 1;
+		return (paddr_t)idx * PAGE_SIZE;
+	}
+
+	spinlock_release(&coremap_lock);
+	*scanned = n;
+	return 0;
+}
+
+/*
+ * Page merging. Like coremap_pickvictim, but with a hand of its own
+ * and no regard for reference bits: return the next unshared,
+ * unpinned, unbusy user page, marked busy, after looking at no more
+ * than MAXSCAN frames (and one full sweep).
+ */
+paddr_t
+coremap_pickmerge(unsigned maxscan, unsigned *scanned,
+		  struct addrspace **as_ret, vaddr_t *vaddr_ret)
+{
+	struct coremap_entry *cme;
+	unsigned n, idx;
+
+	if (maxscan > cm_nframes - cm_base) {
+		maxscan = cm_nframes - cm_base;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	if (cm_mergehand < cm_base) {
+		cm_mergehand = cm_base;
+	}
+	for (n = 0; n < maxscan; n++) {
+		idx = cm_mergehand;
+		cm_mergehand++;
+		if (cm_mergehand == cm_nframes) {
+			cm_mergehand = cm_base;
+		}
+
+		cme = &coremap[idx];
+		spinlock_acquire(CM_FRAMELOCK(idx));
+		if (!cm_ownedidle(cme)) {
+			spinlock_release(CM_FRAMELOCK(idx));
+			continue;
+		}
+
+		cme->cme_busy = 1;
+		*as_ret = cme->cme_as;
+		*vaddr_ret = cme->cme_vaddr;
+		spinlock_release(CM_FRAMELOCK(idx));
+		spinlock_release(&coremap_lock);
+		*scanned = n + 1;
+		return (paddr_t)idx * PAGE_SIZE;
+	}
+
+	spinlock_release(&coremap_lock);
+	*scanned = n;
+	return 0;
+}
+
+/*
+ * Mark the frame at PADDR busy if it is (still) an unshared, unpinned
+ * user page with an owner, returning the owner in AS_RET and
+ * VADDR_RET. Returns false otherwise.
+ */
+bool
+coremap_trybusy(paddr_t paddr, struct addrspace **as_ret, vaddr_t *vaddr_ret)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+	struct coremap_entry *cme;
+	bool ok;
+
+	if (idx < cm_base || idx >= cm_nframes) {
+		return false;
+	}
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	cme = &coremap[idx];
+	ok = cm_ownedidle(cme);
+	if (ok) {
+		cme->cme_busy = 1;
+		*as_ret = cme->cme_as;
+		*vaddr_ret = cme->cme_vaddr;
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+
+	return ok;
+}
+
+/*
+ * Clear the busy mark set by coremap_pickvictim and wake anyone
+ * waiting for it.
+ */
+void
+coremap_unbusy(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	KASSERT(coremap[idx].cme_busy);
+	coremap[idx].cme_busy = 0;
+	wchan_wakeall(CM_WCHAN(idx), CM_FRAMELOCK(idx));
+	spinlock_release(CM_FRAMELOCK(idx));
+}
+
+/*
+ * Wait until the frame at PADDR is not busy.
+ */
+void
+coremap_waitbusy(paddr_t paddr)
+{
+	unsigned idx = paddr / PAGE_SIZE;
+
+	KASSERT(idx < cm_nframes);
+
+	spinlock_acquire(CM_FRAMELOCK(idx));
+	while (coremap[idx].cme_busy) {
+		wchan_sleep(CM_WCHAN(idx), CM_FRAMELOCK(idx));
+	}
+	spinlock_release(CM_FRAMELOCK(idx));
+}
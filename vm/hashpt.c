@@ -0,0 +1,241 @@
+/*
+ * Hashed page tables for MY_VM (options hashpt). See pt.h for the
+ * entry format and pt.c for the default two-level tables.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <membar.h>
+#include <vm.h>
+#include <coremap.h>
+#include <kmemcache.h>
+#include <pt.h>
+
+/*
+ * All address spaces share one hash table of entries, keyed by an
+ * address space ID (a number given to each page table when it is
+ * created; the TLB's ASIDs are per-cpu and get recycled) and a
+ * virtual page number. It has about one bucket per physical frame,
+ * so the table itself is sized by RAM rather than by the number of
+ * processes, and each address space only pays for the pages it has
+ * actually touched.
+ *
+ * An entry, once made, stays where it is until its page table is
+ * destroyed, since pt_lookup hands out pointers to it; entries of a
+ * page table are also kept on a list of their own for pt_destroy.
+ *
+ * Entries and page table structures come from object caches of their
+ * own, and pt_memory counts the slab pages those hold, so that the
+ * comparison with the two-level tables (which count whole pages)
+ * isn't skewed by counting just the structures.
+ */
+struct hpte {
+	pte_t hp_pte;
+	unsigned hp_asid;
+	vaddr_t hp_vpage;
+	struct hpte *hp_next;		/* hash chain */
+	struct hpte *hp_ptnext;		/* entries of the same page table */
+};
+
+struct pagetable {
+	unsigned pt_asid;
+	struct hpte *pt_entries;
+};
+
+/* Everything below is protected by hpt_lock. */
+static struct spinlock hpt_lock = SPINLOCK_INITIALIZER;
+static struct hpte **hpt_buckets;
+static unsigned hpt_nbuckets;		/* a power of two */
+static unsigned hpt_nextasid;
+static size_t hpt_bytes;		/* bucket array, for pt_memory */
+
+/* Set up with the buckets. */
+static struct kmem_cache *hpt_ptcache;	/* struct pagetable */
+static struct kmem_cache *hpt_entcache;	/* struct hpte */
+
+static
+unsigned
+hpt_hash(unsigned asid, vaddr_t vpage)
+{
+	return ((vpage / PAGE_SIZE) ^ (asid * 2654435761U)) &
+		(hpt_nbuckets - 1);
+}
+
+/*
+ * Make the bucket array and the object caches, the first time a page
+ * table is created (after the coremap is up, so we know how big RAM
+ * is). The array is a power of two of pointers, which kmalloc gives
+ * out without rounding up, so its size is counted as is.
+ */
+static
+bool
+hpt_init(void)
+{
+	struct hpte **buckets;
+	struct kmem_cache *ptcache, *entcache;
+	unsigned n, i;
+
+	if (hpt_buckets != NULL) {
+		return true;
+	}
+
+	for (n = 1; n < coremap_nframes(); n *= 2) {
+		/* nothing */
+	}
+	ptcache = kmem_cache_create("hashpt", sizeof(struct pagetable),
+				    NULL, NULL);
+	entcache = kmem_cache_create("hpte", sizeof(struct hpte),
+				     NULL, NULL);
+	buckets = kmalloc(n * sizeof(*buckets));
+	if (ptcache != NULL && entcache != NULL && buckets != NULL) {
+		for (i=0; i<n; i++) {
+			buckets[i] = NULL;
+		}
+
+		spinlock_acquire(&hpt_lock);
+		if (hpt_buckets == NULL) {
+			hpt_ptcache = ptcache;
+			hpt_entcache = entcache;
+			hpt_nbuckets = n;
+			hpt_bytes += n * sizeof(*buckets);
+			/* Last, since hpt_buckets says the rest is ready. */
+			membar_store_store();
+			hpt_buckets = buckets;
+			spinlock_release(&hpt_lock);
+			return true;
+		}
+		spinlock_release(&hpt_lock);
+	}
+
+	/* Out of memory, or someone else got there first. */
+	if (ptcache != NULL) {
+		kmem_cache_destroy(ptcache);
+	}
+	if (entcache != NULL) {
+		kmem_cache_destroy(entcache);
+	}
+	kfree(buckets);
+	return hpt_buckets != NULL;
+}
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	if (!hpt_init()) {
+		return NULL;
+	}
+
+	pt = kmem_cache_alloc(hpt_ptcache);
+	if (pt == NULL) {
+		return NULL;
+	}
+	pt->pt_entries = NULL;
+
+	spinlock_acquire(&hpt_lock);
+	pt->pt_asid = hpt_nextasid++;
+	spinlock_release(&hpt_lock);
+
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	struct hpte *hp, **hpp;
+
+	KASSERT(pt != NULL);
+
+	while ((hp = pt->pt_entries) != NULL) {
+		pt->pt_entries = hp->hp_ptnext;
+
+		spinlock_acquire(&hpt_lock);
+		hpp = &hpt_buckets[hpt_hash(hp->hp_asid, hp->hp_vpage)];
+		while (*hpp != hp) {
+			KASSERT(*hpp != NULL);
+			hpp = &(*hpp)->hp_next;
+		}
+		*hpp = hp->hp_next;
+		spinlock_release(&hpt_lock);
+
+		kmem_cache_free(hpt_entcache, hp);
+	}
+
+	kmem_cache_free(hpt_ptcache, pt);
+}
+
+static
+struct hpte *
+hpt_find(unsigned asid, vaddr_t vpage)
+{
+	struct hpte *hp;
+
+	KASSERT(spinlock_do_i_hold(&hpt_lock));
+
+	for (hp = hpt_buckets[hpt_hash(asid, vpage)]; hp != NULL;
+	     hp = hp->hp_next) {
+		if (hp->hp_asid == asid && hp->hp_vpage == vpage) {
+			return hp;
+		}
+	}
+	return NULL;
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	struct hpte *hp, *newhp;
+	vaddr_t vpage;
+	unsigned b;
+
+	KASSERT(pt != NULL);
+	KASSERT(vaddr < USERSPACETOP);
+
+	vpage = vaddr & PAGE_FRAME;
+
+	spinlock_acquire(&hpt_lock);
+	hp = hpt_find(pt->pt_asid, vpage);
+	spinlock_release(&hpt_lock);
+	if (hp != NULL || !create) {
+		return hp == NULL ? NULL : &hp->hp_pte;
+	}
+
+	/* Allocate outside the lock, then look again. */
+	newhp = kmem_cache_alloc(hpt_entcache);
+	if (newhp == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&hpt_lock);
+	hp = hpt_find(pt->pt_asid, vpage);
+	if (hp == NULL) {
+		newhp->hp_pte = 0;
+		newhp->hp_asid = pt->pt_asid;
+		newhp->hp_vpage = vpage;
+		b = hpt_hash(pt->pt_asid, vpage);
+		newhp->hp_next = hpt_buckets[b];
+		hpt_buckets[b] = newhp;
+		newhp->hp_ptnext = pt->pt_entries;
+		pt->pt_entries = newhp;
+		hp = newhp;
+		newhp = NULL;
+	}
+	spinlock_release(&hpt_lock);
+
+	if (newhp != NULL) {
+		kmem_cache_free(hpt_entcache, newhp);
+	}
+	return &hp->hp_pte;
+}
+
+size_t
+pt_memory(void)
+{
+	if (hpt_buckets == NULL) {
+		return 0;
+	}
+	return hpt_bytes + kmem_cache_memory(hpt_ptcache) +
+		kmem_cache_memory(hpt_entcache);
+}
@@ -29,7 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <membar.h>
+#include <mainbus.h>
 #include <vm.h>
 
 /*
@@ -58,11 +63,12 @@ fill_deadbeef(void *vptr, size_t len)
 //
 // It works like this:
 //
-//    We allocate one page at a time and fill it with objects of size k,
-//    for various k. Each page has its own freelist, maintained by a
-//    linked list in the first word of each object. Each page also has a
-//    freecount, so we know when the page is completely free and can
-//    release it.
+//    We allocate one page at a time (or, for sizes that fit a page
+//    badly, a short run of pages; see heappages[]) and fill it with
+//    objects of size k, for various k. Each page has its own
+//    freelist, maintained by a linked list in the first word of each
+//    object. Each page also has a freecount, so we know when the page
+//    is completely free and can release it.
 //
 //    No assumptions are made about the sizes k; they need not be
 //    powers of two. Note, however, that malloc must always return
@@ -111,6 +117,9 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * GUARDS and LABELS turn off the per-cpu caches (see below), as
+ * blocks going through them would skip the guard and label code.
  */
 
 #undef  SLOW
@@ -121,15 +130,39 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#if !defined(GUARDS) && !defined(LABELS)
+#define PERCPU_CACHES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Powers of two, with a class halfway between each pair, so no block
+ * is more than a third bigger than it needs to be. (The smaller odd
+ * sizes leave a little of each page unused; see kheap_printstats.)
+ */
+#define NSIZES 16
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072,
+};
+
+/*
+ * Pages per heap page, for each size. A single page holds only one
+ * 3072-byte block, or two 1536-byte ones and a 1K tail, so those
+ * sizes get runs of three pages from alloc_kpages instead, which
+ * hold four and eight blocks exactly. In what follows a "heap page"
+ * is the whole run.
+ */
+static const unsigned heappages[NSIZES] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 3, 1, 3,
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SUBPAGE_SIZE 3072
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -153,6 +186,18 @@ struct pageref {
 
 #define INVALID_OFFSET   (0xffff)
 
+/*
+ * Allocations bigger than LARGEST_SUBPAGE_SIZE are runs of whole
+ * pages from alloc_kpages. Each of these also gets a pageref, with
+ * LARGE_BLOCKTYPE as its block type, which isn't on any of the lists
+ * below; for these, nfree is the length of the run in pages, and
+ * freelist_offset the number of bytes unused at the end of it.
+ */
+#define LARGE_BLOCKTYPE  NSIZES
+
+#define HEAPPAGE_SIZE(blk)    (heappages[blk] * PAGE_SIZE)
+#define HEAPPAGE_NBLOCKS(blk) (HEAPPAGE_SIZE(blk) / sizes[blk])
+
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
@@ -160,14 +205,50 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the heap pages and their pagerefs. Most
+ * kmalloc and kfree calls don't take it, though: they are served
+ * from the per-cpu caches below, which only come here to move blocks
+ * in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+#ifdef PERCPU_CACHES
+/*
+ * Per-cpu cache of free blocks, one list for each block size. Only
+ * touched by its own cpu, with interrupts off. See "Per-cpu caches"
+ * below.
+ */
+struct kmcache {
+	struct freelist *kmc_blocks[NSIZES];
+	unsigned kmc_count[NSIZES];
+
+	/* statistics */
+	unsigned kmc_hits;		/* kmallocs served from the cache */
+	unsigned kmc_frees;		/* kfrees into the cache */
+	unsigned kmc_refills;		/* batches taken from the heap pages */
+	unsigned kmc_flushes;		/* batches given back */
+};
+
+static struct kmcache kmcaches[MAXCPUS];
+#endif
+
+/*
+ * Allocation statistics for each block size, and (at LARGE_BLOCKTYPE)
+ * for large runs: the number of allocations, and the bytes they asked
+ * for. Kept per cpu and updated with interrupts off, like the caches;
+ * before there are cpu structures, cpu 0's are used.
+ */
+struct kmstats {
+	unsigned kms_nallocs[NSIZES + 1];
+	uint64_t kms_reqbytes[NSIZES + 1];
+};
+
+static struct kmstats kmstats[MAXCPUS];
+
+/* Large runs with a pageref; protected by kmalloc_spinlock. */
+static unsigned numlargeruns, numlargepages, largewaste;
+
 ////////////////////////////////////////
 
 /*
@@ -185,48 +266,34 @@ struct pagerefpage {
 };
 
 /*
- * This structure holds a pointer to a pageref page and also its
- * bitmap of free entries.
- */
-
-#define INUSE_WORDS (NPAGEREFS_PER_PAGE / 32)
-
-struct kheap_root {
-	struct pagerefpage *page;
-	uint32_t pagerefs_inuse[INUSE_WORDS];
-	unsigned numinuse;
-};
-
-/*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
- *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * Pageref pages are allocated as they are needed, so the heap can
+ * grow as big as memory allows. Once allocated they aren't ever
+ * freed; unused pagerefs are kept on a free list, linked through
+ * next_samesize, so getting and releasing one takes constant time.
  */
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+static struct pageref *freepagerefs;
+static unsigned numpagerefpages;
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+#define TOTAL_PAGEREFS (numpagerefpages * NPAGEREFS_PER_PAGE)
 
 /*
- * Allocate a page to hold pagerefs.
+ * Allocate a page to hold pagerefs, and put them on the free list.
  */
 static
 void
-allocpagerefpage(struct kheap_root *root)
+allocpagerefpage(void)
 {
+	struct pagerefpage *page;
 	vaddr_t va;
-
-	KASSERT(root->page == NULL);
+	unsigned i;
 
 	/*
 	 * We release the spinlock while calling alloc_kpages. This
 	 * avoids deadlock if alloc_kpages needs to come back here.
 	 * Note that this means things can change behind our back...
+	 * but if somebody else added a page meanwhile, we just end up
+	 * with more free pagerefs.
 	 */
 	spinlock_release(&kmalloc_spinlock);
 	va = alloc_kpages(1);
@@ -237,17 +304,12 @@ allocpagerefpage(struct kheap_root *root)
 	}
 	KASSERT(va % PAGE_SIZE == 0);
 
-	if (root->page != NULL) {
-		/* Oops, somebody else allocated it. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(va);
-		spinlock_acquire(&kmalloc_spinlock);
-		/* Once allocated it isn't ever freed. */
-		KASSERT(root->page != NULL);
-		return;
+	page = (struct pagerefpage *)va;
+	for (i=0; i<NPAGEREFS_PER_PAGE; i++) {
+		page->refs[i].next_samesize = freepagerefs;
+		freepagerefs = &page->refs[i];
 	}
-
-	root->page = (struct pagerefpage *)va;
+	numpagerefpages++;
 }
 
 /*
@@ -257,44 +319,21 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
-			continue;
-		}
+	struct pageref *pr;
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (freepagerefs == NULL) {
+		allocpagerefpage();
 	}
 
-	/* ran out */
-	return NULL;
+	pr = freepagerefs;
+	if (pr == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	freepagerefs = pr->next_samesize;
+	return pr;
 }
 
 /*
@@ -304,36 +343,10 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-	unsigned whichroot;
-	struct kheap_root *root;
-	struct pagerefpage *page;
-
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-
-		page = root->page;
-		if (page == NULL) {
-			KASSERT(root->numinuse == 0);
-			continue;
-		}
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-		j = p-page->refs;
-		/* note: j is unsigned, don't test < 0 */
-		if (j < NPAGEREFS_PER_PAGE) {
-			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
-			return;
-		}
-	}
-	/* pageref wasn't on any of the pages */
-	KASSERT(0);
+	p->next_samesize = freepagerefs;
+	freepagerefs = p;
 }
 
 
@@ -346,6 +359,87 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * The pageref of each page of each subpage heap page, and of the
+ * first page of each large run, by physical page number, or NULL for
+ * other pages;
+ * this is how kfree finds a block's page, and its size, in constant
+ * time. It covers all of RAM, and is made by allocpagerefmap when the
+ * first heap page is. Entries are only changed, under
+ * kmalloc_spinlock, when a heap page or large run is made or
+ * released; while anyone holds a block on a page its entry can't
+ * change, so the per-cpu caches read it without the lock.
+ *
+ * If the map can't be allocated we get by with searching allbase.
+ */
+#define KHEAP_PAGENUM(va) (KVADDR_TO_PADDR(va) / PAGE_SIZE)
+
+static struct pageref **pagerefmap;
+static unsigned pagerefmapsize;		/* in entries */
+
+/*
+ * Set the entries for the NPAGES pages starting at PRPAGE to PR.
+ */
+static
+void
+setpagerefmap(vaddr_t prpage, unsigned npages, struct pageref *pr)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (pagerefmap != NULL) {
+		KASSERT(KHEAP_PAGENUM(prpage) + npages <= pagerefmapsize);
+		for (i=0; i<npages; i++) {
+			pagerefmap[KHEAP_PAGENUM(prpage) + i] = pr;
+		}
+	}
+}
+
+/*
+ * Allocate pagerefmap. Called without kmalloc_spinlock.
+ */
+static
+void
+allocpagerefmap(void)
+{
+	struct pageref **map, *pr;
+	unsigned size, i, pagenum;
+	vaddr_t va;
+
+	size = mainbus_ramsize() / PAGE_SIZE;
+	va = alloc_kpages(DIVROUNDUP(size * sizeof(*map), PAGE_SIZE));
+	if (va == 0) {
+		return;
+	}
+	map = (struct pageref **)va;
+	for (i=0; i<size; i++) {
+		map[i] = NULL;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagerefmap == NULL) {
+		/* Enter any heap pages made before the map. */
+		for (pr = allbase; pr != NULL; pr = pr->next_all) {
+			pagenum = KHEAP_PAGENUM(PR_PAGEADDR(pr));
+			KASSERT(pagenum + heappages[PR_BLOCKTYPE(pr)] <= size);
+			for (i=0; i<heappages[PR_BLOCKTYPE(pr)]; i++) {
+				map[pagenum + i] = pr;
+			}
+		}
+		/* Fill it in before the lockless readers can see it. */
+		membar_store_store();
+		pagerefmapsize = size;
+		pagerefmap = map;
+		map = NULL;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (map != NULL) {
+		/* Somebody else made it first. */
+		free_kpages(va);
+	}
+}
+
 ////////////////////////////////////////
 
 #ifdef GUARDS
@@ -532,7 +626,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(prpage < MIPS_KSEG1);
 #endif
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < HEAPPAGE_SIZE(blktype));
 	KASSERT(pr->freelist_offset % blocksize == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -540,7 +634,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + HEAPPAGE_SIZE(blktype));
 		KASSERT((fla-prpage) % blocksize == 0);
 #ifdef CHECKBEEF
 		checkdeadbeef(fl, blocksize);
@@ -557,7 +651,8 @@ checksubpage(struct pageref *pr)
 	KASSERT(nfree==pr->nfree);
 
 #ifdef CHECKGUARDS
-	numblocks = PAGE_SIZE / blocksize;
+	numblocks = HEAPPAGE_NBLOCKS(blktype);
+	KASSERT(numblocks <= maxblocks);
 	for (i=0; i<numblocks; i++) {
 		mask = 1U << (i % 32);
 		if ((isfree[i / 32] & mask) == 0) {
@@ -641,7 +736,7 @@ void
 dump_subpage(struct pageref *pr, unsigned generation)
 {
 	unsigned blocksize = sizes[PR_BLOCKTYPE(pr)];
-	unsigned numblocks = PAGE_SIZE / blocksize;
+	unsigned numblocks = HEAPPAGE_NBLOCKS(PR_BLOCKTYPE(pr));
 	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
 	uint32_t isfree[numfreewords], mask;
 	vaddr_t prpage;
@@ -766,7 +861,7 @@ subpage_stats(struct pageref *pr)
 	KASSERT(blktype >= 0 && blktype < NSIZES);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = HEAPPAGE_NBLOCKS(blktype);
 	KASSERT(n <= 32 * ARRAYCOUNT(freemap));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -802,16 +897,88 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i, j, nheappages, nfree, ncached, nallocs, avg, waste;
+	uint64_t reqbytes;
+#ifdef PERCPU_CACHES
+	struct kmcache *kmc;
+	unsigned nblocks, nbytes;
+#endif
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status (%u pageref pages):\n",
+		numpagerefpages);
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		subpage_stats(pr);
 	}
 
+#ifdef PERCPU_CACHES
+	/* Blocks in the caches show as allocated above. */
+	for (i=0; i<MAXCPUS; i++) {
+		kmc = &kmcaches[i];
+		if (kmc->kmc_hits == 0 && kmc->kmc_frees == 0) {
+			continue;
+		}
+		nblocks = nbytes = 0;
+		for (j=0; j<NSIZES; j++) {
+			nblocks += kmc->kmc_count[j];
+			nbytes += kmc->kmc_count[j] * sizes[j];
+		}
+		kprintf("cpu%u cache: %u blocks (%u bytes); %u kmallocs, "
+			"%u kfrees, %u refills, %u flushes\n", i, nblocks,
+			nbytes, kmc->kmc_hits, kmc->kmc_frees,
+			kmc->kmc_refills, kmc->kmc_flushes);
+	}
+#endif
+
+	/*
+	 * Per size: blocks in use, the space left over at the end of
+	 * each heap page, and, over all allocations so far, the average
+	 * request and the share of the blocks handed out that went
+	 * unused by the caller.
+	 */
+	kprintf("size pages  inuse  tailwaste    allocs  avgreq  waste\n");
+	for (j=0; j<=NSIZES; j++) {
+		nallocs = 0;
+		reqbytes = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			nallocs += kmstats[i].kms_nallocs[j];
+			reqbytes += kmstats[i].kms_reqbytes[j];
+		}
+		avg = nallocs == 0 ? 0 : reqbytes / nallocs;
+
+		if (j == NSIZES) {
+			kprintf("large: %u runs, %u pages, %u bytes unused; "
+				"%u allocs, avg request %u\n", numlargeruns,
+				numlargepages, largewaste, nallocs, avg);
+			break;
+		}
+
+		nheappages = nfree = 0;
+		for (pr = sizebases[j]; pr != NULL; pr = pr->next_samesize) {
+			nheappages++;
+			nfree += pr->nfree;
+		}
+		ncached = 0;
+#ifdef PERCPU_CACHES
+		for (i=0; i<MAXCPUS; i++) {
+			ncached += kmcaches[i].kmc_count[j];
+		}
+#endif
+		if (nheappages == 0 && nallocs == 0) {
+			continue;
+		}
+		waste = nallocs == 0 ? 0 :
+			100 - reqbytes * 100 / ((uint64_t)nallocs * sizes[j]);
+		kprintf("%4lu %5u %6u %10u %9u %7u %5u%%\n",
+			(unsigned long)sizes[j], nheappages * heappages[j],
+			nheappages * HEAPPAGE_NBLOCKS(j) - nfree - ncached,
+			nheappages * (HEAPPAGE_SIZE(j) % sizes[j]),
+			nallocs, avg, waste);
+	}
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -867,6 +1034,150 @@ int blocktype(size_t clientsz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of the heap page PR, which must have
+ * one.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < HEAPPAGE_SIZE(PR_BLOCKTYPE(pr)));
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < HEAPPAGE_SIZE(PR_BLOCKTYPE(pr)));
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at OFFSET on the heap page PR back on the page's
+ * freelist. If that makes the whole page free, take the page off the
+ * lists and return true; the caller should then free it with
+ * free_kpages, after releasing kmalloc_spinlock.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= HEAPPAGE_NBLOCKS(blktype));
+	if (pr->nfree == HEAPPAGE_NBLOCKS(blktype)) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		setpagerefmap(prpage, heappages[blktype], NULL);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Find the heap page holding PTRADDR, or return NULL if it isn't on
+ * any of ours.
+ */
+static
+struct pageref *
+subpage_findpage(vaddr_t ptraddr)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t pagenum;	// physical page number of ptraddr
+	int blktype;		// index into sizes[] that we're using
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (pagerefmap != NULL) {
+		pagenum = KHEAP_PAGENUM(ptraddr);
+		if (pagenum >= pagerefmapsize) {
+			return NULL;
+		}
+		pr = pagerefmap[pagenum];
+		if (pr != NULL) {
+			/* large runs are taken care of by large_kfree */
+			KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+			checksubpage(pr);
+		}
+		return pr;
+	}
+
+	/* No map (yet); search. */
+	for (pr = allbase; pr; pr = pr->next_all) {
+		prpage = PR_PAGEADDR(pr);
+		blktype = PR_BLOCKTYPE(pr);
+
+		/* check for corruption */
+		KASSERT(blktype>=0 && blktype<NSIZES);
+		checksubpage(pr);
+
+		if (ptraddr >= prpage &&
+		    ptraddr < prpage + HEAPPAGE_SIZE(blktype)) {
+			break;
+		}
+	}
+	return pr;
+}
+
 /*
  * Allocate a block of size SZ, where SZ is not large enough to
  * warrant a whole-page allocation.
@@ -922,25 +1233,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 #ifdef GUARDS
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
@@ -965,7 +1258,10 @@ subpage_kmalloc(size_t sz
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	if (pagerefmap == NULL) {
+		allocpagerefmap();
+	}
+	prpage = alloc_kpages(heappages[blktype]);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
@@ -974,7 +1270,7 @@ subpage_kmalloc(size_t sz
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
-	fill_deadbeef((void *)prpage, PAGE_SIZE);
+	fill_deadbeef((void *)prpage, HEAPPAGE_SIZE(blktype));
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -988,7 +1284,8 @@ subpage_kmalloc(size_t sz
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = HEAPPAGE_NBLOCKS(blktype);
+	setpagerefmap(prpage, heappages[blktype], pr);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1030,8 +1327,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
@@ -1066,30 +1361,21 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = subpage_findpage(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= HEAPPAGE_SIZE(blktype) ||
+	    offset % sizes[blktype] != 0 ||
+	    offset / sizes[blktype] >= HEAPPAGE_NBLOCKS(blktype)) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -1105,40 +1391,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_putblock(pr, offset)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1156,17 +1409,395 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+//
+// Per-cpu caches.
+//
+//    Each cpu keeps, for each block size, a short list of free blocks
+//    of its own, linked through their first words like the freelists
+//    on the heap pages. kmalloc and kfree use it with interrupts off
+//    and without taking kmalloc_spinlock. Only when the list runs dry,
+//    or grows past kmc_limit(), does the cpu take the lock, and then
+//    it moves half a list's worth of blocks at a time between the list
+//    and the heap pages on sizebases[].
+//
+//    A block freed on a different cpu from the one that allocated it
+//    just goes on the freeing cpu's list. Blocks on a list still count
+//    as allocated as far as their heap page is concerned, so the page
+//    stays put until they are flushed back to it.
+//
+
+#ifdef PERCPU_CACHES
+
+/* A cpu keeps at most this many bytes, and blocks, of each size. */
+#define KMC_BYTES	(PAGE_SIZE / 2)
+#define KMC_MAX		32
+
+/*
+ * The number of blocks of type BLKTYPE a cache may hold before it
+ * gives half of them back.
+ */
+static
+unsigned
+kmc_limit(unsigned blktype)
+{
+	unsigned limit = KMC_BYTES / sizes[blktype];
+
+	if (limit == 0) {
+		/* Blocks bigger than KMC_BYTES: keep one. */
+		return 1;
+	}
+	return limit < KMC_MAX ? limit : KMC_MAX;
+}
+
+/*
+ * Take up to N free blocks of type BLKTYPE off the heap pages, as a
+ * list. Doesn't make new pages; returns NULL if there aren't any free
+ * blocks of that size.
+ */
+static
+struct freelist *
+kmc_takebatch(unsigned blktype, unsigned n)
+{
+	struct pageref *pr;
+	struct freelist *batch = NULL, *fl;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (pr = sizebases[blktype]; pr != NULL && n > 0;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		while (pr->nfree > 0 && n > 0) {
+			fl = subpage_takeblock(pr);
+			fl->next = batch;
+			batch = fl;
+			n--;
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return batch;
+}
+
+/*
+ * Give a list of free blocks back to their heap pages, and release
+ * any pages that become completely free.
+ */
+static
+void
+kmc_putbatch(struct freelist *batch)
+{
+	struct freelist *fl;
+	struct pageref *pr;
+	vaddr_t prpage, freepages[KMC_MAX];
+	unsigned i, nfreepages = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	while (batch != NULL) {
+		fl = batch;
+		batch = fl->next;
+
+		pr = subpage_findpage((vaddr_t)fl);
+		KASSERT(pr != NULL);
+		prpage = PR_PAGEADDR(pr);
+		if (subpage_putblock(pr, (vaddr_t)fl - prpage)) {
+			KASSERT(nfreepages < KMC_MAX);
+			freepages[nfreepages++] = prpage;
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Allocate a block of type BLKTYPE from this cpu's cache, refilling
+ * the cache from the heap pages if it's empty. Returns NULL if there
+ * are no free blocks of that size anywhere, in which case
+ * subpage_kmalloc should make a new page.
+ */
+static
+void *
+kmc_alloc(unsigned blktype)
+{
+	struct kmcache *kmc;
+	struct freelist *fl, *batch, *next;
+	int spl;
+
+	spl = splhigh();
+	kmc = &kmcaches[curcpu->c_number];
+	fl = kmc->kmc_blocks[blktype];
+	if (fl != NULL) {
+		kmc->kmc_blocks[blktype] = fl->next;
+		kmc->kmc_count[blktype]--;
+		kmc->kmc_hits++;
+		splx(spl);
+		return fl;
+	}
+	splx(spl);
+
+	batch = kmc_takebatch(blktype, DIVROUNDUP(kmc_limit(blktype), 2));
+	if (batch == NULL) {
+		return NULL;
+	}
+	fl = batch;
+	batch = fl->next;
+
+	/* We might be on a different cpu by now; that's fine. */
+	spl = splhigh();
+	kmc = &kmcaches[curcpu->c_number];
+	for (; batch != NULL; batch = next) {
+		next = batch->next;
+		batch->next = kmc->kmc_blocks[blktype];
+		kmc->kmc_blocks[blktype] = batch;
+		kmc->kmc_count[blktype]++;
+	}
+	kmc->kmc_hits++;
+	kmc->kmc_refills++;
+	splx(spl);
+
+	return fl;
+}
+
+/*
+ * Free the block PTR, of type BLKTYPE, into this cpu's cache. If the
+ * cache is full, give half of it back to the heap pages.
+ */
+static
+void
+kmc_free(void *ptr, unsigned blktype)
+{
+	struct kmcache *kmc;
+	struct freelist *fl = ptr, *batch = NULL, *victim;
+	unsigned n;
+	int spl;
+
+	spl = splhigh();
+	kmc = &kmcaches[curcpu->c_number];
+
+	/* this block should not already be in the cache! (check the head) */
+	KASSERT(fl != kmc->kmc_blocks[blktype]);
+
+	if (kmc->kmc_count[blktype] >= kmc_limit(blktype)) {
+		for (n = DIVROUNDUP(kmc_limit(blktype), 2); n > 0; n--) {
+			victim = kmc->kmc_blocks[blktype];
+			kmc->kmc_blocks[blktype] = victim->next;
+			kmc->kmc_count[blktype]--;
+			victim->next = batch;
+			batch = victim;
+		}
+		kmc->kmc_flushes++;
+	}
+	fl->next = kmc->kmc_blocks[blktype];
+	kmc->kmc_blocks[blktype] = fl;
+	kmc->kmc_count[blktype]++;
+	kmc->kmc_frees++;
+	splx(spl);
+
+	if (batch != NULL) {
+		kmc_putbatch(batch);
+	}
+}
+
+/*
+ * Free PTR into the per-cpu caches, using pagerefmap to find its size
+ * without taking kmalloc_spinlock. Returns false if there is no map
+ * or no cpu structure yet, in which case the caller should do it the
+ * slow way.
+ */
+static
+bool
+kmc_kfree(void *ptr)
+{
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	vaddr_t pagenum, offset;
+	struct pageref *pr;
+	unsigned blktype;
+
+	pagenum = KHEAP_PAGENUM(ptraddr);
+	if (!CURCPU_EXISTS() || pagerefmap == NULL ||
+	    pagenum >= pagerefmapsize) {
+		return false;
+	}
+
+	pr = pagerefmap[pagenum];
+	if (pr == NULL) {
+		/* Not a heap page, so it's a big allocation. */
+		KASSERT(ptraddr % PAGE_SIZE == 0);
+		free_kpages(ptraddr);
+		return true;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+	if (blktype == LARGE_BLOCKTYPE) {
+		/* Leave it to large_kfree. */
+		return false;
+	}
+	KASSERT(blktype < NSIZES);
+
+	/* Check for proper positioning and alignment */
+	offset = ptraddr - PR_PAGEADDR(pr);
+	if (offset % sizes[blktype] != 0 ||
+	    offset / sizes[blktype] >= HEAPPAGE_NBLOCKS(blktype)) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/* As in subpage_kfree. */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	kmc_free(ptr, blktype);
+	return true;
+}
+
+#endif /* PERCPU_CACHES */
+
+////////////////////////////////////////
+//
+// Large allocations.
+//
+//    These are just runs of whole pages from alloc_kpages, but each
+//    gets a pageref entered in pagerefmap (once there is one), so
+//    kfree can tell them from subpage blocks at once and we can count
+//    the space they waste.
+//
+
+/*
+ * Allocate SZ bytes, more than LARGEST_SUBPAGE_SIZE, as a run of
+ * whole pages.
+ */
+static
+void *
+large_kmalloc(size_t sz)
+{
+	struct pageref *pr = NULL;
+	unsigned long npages;
+	vaddr_t address;
+
+	/* Round up to a whole number of pages. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	KASSERT(npages <= 0xffff);
+
+	if (pagerefmap != NULL) {
+		spinlock_acquire(&kmalloc_spinlock);
+		pr = allocpageref();
+		spinlock_release(&kmalloc_spinlock);
+		if (pr == NULL) {
+			kprintf("kmalloc: Couldn't get pageref for large "
+				"allocation\n");
+			return NULL;
+		}
+	}
+
+	address = alloc_kpages(npages);
+	if (address==0) {
+		if (pr != NULL) {
+			spinlock_acquire(&kmalloc_spinlock);
+			freepageref(pr);
+			spinlock_release(&kmalloc_spinlock);
+		}
+		return NULL;
+	}
+	KASSERT(address % PAGE_SIZE == 0);
+
+	if (pr != NULL) {
+		pr->pageaddr_and_blocktype = MKPAB(address, LARGE_BLOCKTYPE);
+		pr->nfree = npages;
+		pr->freelist_offset = npages * PAGE_SIZE - sz;
+		pr->next_samesize = pr->next_all = NULL;
+
+		spinlock_acquire(&kmalloc_spinlock);
+		setpagerefmap(address, 1, pr);
+		numlargeruns++;
+		numlargepages += npages;
+		largewaste += pr->freelist_offset;
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	return (void *)address;
+}
+
+/*
+ * Free PTR if it is a large run with a pageref. If it isn't, return
+ * false.
+ */
+static
+bool
+large_kfree(void *ptr)
+{
+	vaddr_t address = (vaddr_t)ptr;
+	struct pageref *pr = NULL;
+
+	if (address % PAGE_SIZE != 0) {
+		return false;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagerefmap != NULL &&
+	    KHEAP_PAGENUM(address) < pagerefmapsize) {
+		pr = pagerefmap[KHEAP_PAGENUM(address)];
+	}
+	if (pr == NULL || PR_BLOCKTYPE(pr) != LARGE_BLOCKTYPE) {
+		spinlock_release(&kmalloc_spinlock);
+		return false;
+	}
+	KASSERT(PR_PAGEADDR(pr) == address);
+
+	setpagerefmap(address, 1, NULL);
+	KASSERT(numlargeruns > 0);
+	numlargeruns--;
+	numlargepages -= pr->nfree;
+	largewaste -= pr->freelist_offset;
+	freepageref(pr);
+	spinlock_release(&kmalloc_spinlock);
+
+	free_kpages(address);
+	return true;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 /*
- * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * Count an allocation of SZ bytes of type BLKTYPE.
+ */
+static
+void
+kmstats_count(unsigned blktype, size_t sz)
+{
+	struct kmstats *kms;
+	int spl;
+
+	spl = splhigh();
+	kms = &kmstats[CURCPU_EXISTS() ? curcpu->c_number : 0];
+	kms->kms_nallocs[blktype]++;
+	kms->kms_reqbytes[blktype] += sz;
+	splx(spl);
+}
+
+/*
+ * Allocate a block of size SZ. Redirect either to the per-cpu caches
+ * and subpage_kmalloc, or to large_kmalloc, depending on how big SZ is.
  */
 void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	unsigned blktype;
+	void *ptr;
 #ifdef LABELS
 	vaddr_t label;
 #endif
@@ -1180,26 +1811,34 @@ kmalloc(size_t sz)
 #endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+	if (checksz > LARGEST_SUBPAGE_SIZE) {
+		ptr = large_kmalloc(sz);
+		if (ptr != NULL) {
+			kmstats_count(LARGE_BLOCKTYPE, sz);
 		}
-		KASSERT(address % PAGE_SIZE == 0);
+		return ptr;
+	}
 
-		return (void *)address;
+	blktype = blocktype(checksz);
+	ptr = NULL;
+
+#ifdef PERCPU_CACHES
+	if (CURCPU_EXISTS()) {
+		ptr = kmc_alloc(blktype);
 	}
+#endif
 
+	if (ptr == NULL) {
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+		ptr = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+		ptr = subpage_kmalloc(sz);
 #endif
+	}
+	if (ptr != NULL) {
+		kmstats_count(blktype, sz);
+	}
+	return ptr;
 }
 
 /*
@@ -1209,11 +1848,21 @@ void
 kfree(void *ptr)
 {
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try large runs and subpage first; if that fails, assume it's
+	 * a big allocation made before there was a pagerefmap.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef PERCPU_CACHES
+	else if (kmc_kfree(ptr)) {
+		return;
+	}
+#endif
+	else if (large_kfree(ptr)) {
+		return;
+	}
+	else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
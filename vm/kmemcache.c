@@ -0,0 +1,342 @@
+/*
+ * Object caches. See kmemcache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+/* Objects are aligned like kmalloc's blocks. */
+#define KC_ALIGN	8
+
+/*
+ * Header at the start of each slab. It is followed by the stack of
+ * free object numbers, and then, aligned, by the objects themselves.
+ */
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* on kc_partial */
+	struct kmem_slab *ks_prev;
+	unsigned ks_nfree;
+	uint16_t ks_free[];
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;			/* object size, rounded up */
+	unsigned kc_perslab;		/* objects per slab */
+	size_t kc_offset;		/* of the first object in a slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kmem_cache *kc_next;	/* on kc_all */
+
+	/*
+	 * Everything below is protected by kc_lock. Slabs with some
+	 * objects free are on kc_partial; one slab with all of them
+	 * free may be kept in kc_empty; full slabs aren't on any list.
+	 */
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_empty;
+
+	/* Statistics */
+	unsigned kc_nslabs;		/* slabs held */
+	unsigned kc_ninuse;		/* objects allocated */
+	unsigned kc_nallocs;		/* kmem_cache_alloc calls */
+	unsigned kc_nctors;		/* constructor calls */
+};
+
+/* All caches, for kmem_cache_printstats. */
+static struct spinlock kc_all_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kc_all;
+
+static
+void *
+kc_obj(struct kmem_cache *kc, struct kmem_slab *ks, unsigned ix)
+{
+	return (void *)((vaddr_t)ks + kc->kc_offset + ix * kc->kc_size);
+}
+
+static
+void
+kc_insert(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	ks->ks_prev = NULL;
+	ks->ks_next = kc->kc_partial;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks;
+	}
+	kc->kc_partial = ks;
+}
+
+static
+void
+kc_remove(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(kc->kc_partial == ks);
+		kc->kc_partial = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Destroy the first N objects of a slab and give its page back.
+ */
+static
+void
+kc_freeslab(struct kmem_cache *kc, struct kmem_slab *ks, unsigned n)
+{
+	unsigned i;
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			kc->kc_dtor(kc_obj(kc, ks, i));
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Make a new slab, constructing all its objects. Called without
+ * kc_lock, as the constructor may sleep or allocate memory.
+ */
+static
+struct kmem_slab *
+kc_makeslab(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	unsigned i;
+	int result;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+
+	if (kc->kc_ctor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			result = kc->kc_ctor(kc_obj(kc, ks, i));
+			if (result) {
+				kc_freeslab(kc, ks, i);
+				return NULL;
+			}
+		}
+	}
+
+	/* Hand them out from the start of the slab. */
+	for (i=0; i<kc->kc_perslab; i++) {
+		ks->ks_free[i] = kc->kc_perslab - 1 - i;
+	}
+	ks->ks_nfree = kc->kc_perslab;
+	return ks;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned n;
+
+	KASSERT(size > 0 && size <= PAGE_SIZE / 4);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+
+	/* As many objects as fit after the header and the free stack. */
+	kc->kc_size = ROUNDUP(size, KC_ALIGN);
+	n = (PAGE_SIZE - sizeof(struct kmem_slab)) /
+		(kc->kc_size + sizeof(uint16_t));
+	while (ROUNDUP(sizeof(struct kmem_slab) + n * sizeof(uint16_t),
+		       KC_ALIGN) + n * kc->kc_size > PAGE_SIZE) {
+		n--;
+	}
+	KASSERT(n > 0);
+	kc->kc_perslab = n;
+	kc->kc_offset = ROUNDUP(sizeof(struct kmem_slab) +
+				n * sizeof(uint16_t), KC_ALIGN);
+
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_ninuse = 0;
+	kc->kc_nallocs = 0;
+	kc->kc_nctors = 0;
+
+	spinlock_acquire(&kc_all_lock);
+	kc->kc_next = kc_all;
+	kc_all = kc;
+	spinlock_release(&kc_all_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+
+	spinlock_acquire(&kc_all_lock);
+	for (kcp = &kc_all; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kc_all_lock);
+
+	KASSERT(kc->kc_ninuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	if (kc->kc_empty != NULL) {
+		kc_freeslab(kc, kc->kc_empty, kc->kc_perslab);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	unsigned ix;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	ks = kc->kc_partial;
+	if (ks == NULL && kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		kc->kc_empty = NULL;
+		kc_insert(kc, ks);
+	}
+	if (ks == NULL) {
+		spinlock_release(&kc->kc_lock);
+		ks = kc_makeslab(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nslabs++;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_nctors += kc->kc_perslab;
+		}
+		kc_insert(kc, ks);
+	}
+
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(ks->ks_nfree > 0);
+	ix = ks->ks_free[--ks->ks_nfree];
+	if (ks->ks_nfree == 0) {
+		kc_remove(kc, ks);
+	}
+	kc->kc_ninuse++;
+	kc->kc_nallocs++;
+
+	spinlock_release(&kc->kc_lock);
+
+	return kc_obj(kc, ks, ix);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+	vaddr_t offset;
+	unsigned ix;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(ks->ks_cache == kc);
+	offset = (vaddr_t)obj - (vaddr_t)ks - kc->kc_offset;
+	KASSERT(offset % kc->kc_size == 0);
+	ix = offset / kc->kc_size;
+	KASSERT(ix < kc->kc_perslab);
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0) {
+		kc_insert(kc, ks);
+	}
+	ks->ks_free[ks->ks_nfree++] = ix;
+	kc->kc_ninuse--;
+
+	if (ks->ks_nfree < kc->kc_perslab) {
+		ks = NULL;
+	}
+	else {
+		/* Keep one free slab; give back any more. */
+		kc_remove(kc, ks);
+		if (kc->kc_empty == NULL) {
+			kc->kc_empty = ks;
+			ks = NULL;
+		}
+		else {
+			kc->kc_nslabs--;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if (ks != NULL) {
+		kc_freeslab(kc, ks, kc->kc_perslab);
+	}
+}
+
+size_t
+kmem_cache_memory(struct kmem_cache *kc)
+{
+	size_t bytes;
+
+	spinlock_acquire(&kc->kc_lock);
+	bytes = (size_t)kc->kc_nslabs * PAGE_SIZE;
+	spinlock_release(&kc->kc_lock);
+	return bytes;
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kc_all_lock);
+	kprintf("Object caches:\n");
+	for (kc = kc_all; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-12s %4u bytes, %3u per slab (%4u bytes unused): "
+			"%u in use in %u slabs, %u allocs, %u constructed\n",
+			kc->kc_name, (unsigned)kc->kc_size, kc->kc_perslab,
+			(unsigned)(PAGE_SIZE - kc->kc_perslab * kc->kc_size),
+			kc->kc_ninuse, kc->kc_nslabs, kc->kc_nallocs,
+			kc->kc_nctors);
+	}
+	spinlock_release(&kc_all_lock);
+}
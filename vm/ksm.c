@@ -0,0 +1,311 @@
+/*
+ * Same-page merging. See ksm.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vm.h>
+#include <coremap.h>
+#include <ksm.h>
+
+/* Default scan rate: a full pass over memory every this many seconds. */
+#define KSM_SCANDIV	4
+
+#define KSM_NBUCKETS	256
+
+struct ksm_node {
+	uint32_t kn_hash;		/* hash of the page contents */
+	paddr_t kn_paddr;		/* the frame */
+	struct ksm_node *kn_next;
+};
+
+/*
+ * The stable table holds merged frames, with a reference to each; it
+ * is protected by ksm_lock. The unstable table holds candidates seen
+ * this pass, without references, and is only used by the thread.
+ */
+static struct lock *ksm_lock;
+static struct ksm_node *ksm_stable[KSM_NBUCKETS];
+static struct ksm_node *ksm_unstable[KSM_NBUCKETS];
+
+static unsigned ksm_scanrate;
+
+/* Statistics */
+static unsigned ksm_nscanned;		/* frames looked at */
+static unsigned ksm_npasses;		/* full passes over memory */
+static unsigned ksm_nmerged;		/* pages remapped to a merged frame */
+
+/*
+ * FNV-1a over the words of the page.
+ */
+static
+uint32_t
+ksm_hash(paddr_t paddr)
+{
+	const uint32_t *p = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+	uint32_t h = 2166136261U;
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+	return h;
+}
+
+static
+bool
+ksm_samepage(paddr_t a, paddr_t b)
+{
+	const uint32_t *pa = (const uint32_t *)PADDR_TO_KVADDR(a);
+	const uint32_t *pb = (const uint32_t *)PADDR_TO_KVADDR(b);
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (pa[i] != pb[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static
+void
+ksm_insert(struct ksm_node **table, struct ksm_node *kn)
+{
+	struct ksm_node **bucket = &table[kn->kn_hash % KSM_NBUCKETS];
+
+	kn->kn_next = *bucket;
+	*bucket = kn;
+}
+
+/*
+ * Remove and return the first node in TABLE with hash HASH, other
+ * than one for the frame SKIP.
+ */
+static
+struct ksm_node *
+ksm_take(struct ksm_node **table, uint32_t hash, paddr_t skip)
+{
+	struct ksm_node **knp, *kn;
+
+	for (knp = &table[hash % KSM_NBUCKETS]; *knp != NULL;
+	     knp = &(*knp)->kn_next) {
+		kn = *knp;
+		if (kn->kn_hash == hash && kn->kn_paddr != skip) {
+			*knp = kn->kn_next;
+			return kn;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Try to merge the page at VADDR in AS, held in the busy frame PADDR.
+ * Returns true if it was remapped to a merged frame, in which case
+ * PADDR is the caller's to free.
+ */
+static
+bool
+ksm_page(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct ksm_node *kn;
+	struct addrspace *qas;
+	vaddr_t qvaddr;
+	paddr_t qpaddr;
+	uint32_t hash;
+	bool merged = false;
+
+	hash = ksm_hash(paddr);
+
+	lock_acquire(ksm_lock);
+
+	for (kn = ksm_stable[hash % KSM_NBUCKETS]; kn != NULL; kn = kn->kn_next) {
+		if (kn->kn_hash == hash) {
+			break;
+		}
+	}
+	if (kn != NULL) {
+		/* Looks like a merged frame; check properly. */
+		if (vm_ksmprotect(as, vaddr, paddr)) {
+			for (; kn != NULL; kn = kn->kn_next) {
+				if (kn->kn_hash == hash &&
+				    ksm_samepage(paddr, kn->kn_paddr)) {
+					merged = vm_ksmreplace(as, vaddr, paddr,
+							       kn->kn_paddr);
+					break;
+				}
+			}
+		}
+		lock_release(ksm_lock);
+		return merged;
+	}
+
+	kn = ksm_take(ksm_unstable, hash, paddr);
+	if (kn != NULL) {
+		/* Seen one like it this pass; see if it still is. */
+		qpaddr = kn->kn_paddr;
+		if (coremap_trybusy(qpaddr, &qas, &qvaddr)) {
+			if (vm_ksmprotect(qas, qvaddr, qpaddr) &&
+			    vm_ksmprotect(as, vaddr, paddr) &&
+			    ksm_samepage(paddr, qpaddr) &&
+			    vm_ksmshare(qas, qvaddr, qpaddr)) {
+				/* It can't change now; rehash to be sure. */
+				kn->kn_hash = ksm_hash(qpaddr);
+				ksm_insert(ksm_stable, kn);
+				kn = NULL;
+				merged = vm_ksmreplace(as, vaddr, paddr, qpaddr);
+			}
+			coremap_unbusy(qpaddr);
+		}
+	}
+	else {
+		kn = kmalloc(sizeof(*kn));
+	}
+	if (kn != NULL) {
+		/* This page is now the candidate for its hash. */
+		kn->kn_hash = hash;
+		kn->kn_paddr = paddr;
+		ksm_insert(ksm_unstable, kn);
+	}
+
+	lock_release(ksm_lock);
+	return merged;
+}
+
+/*
+ * End of a pass: forget the candidates, and drop merged frames that
+ * at most one mapping besides the stable table refers to any more.
+ * Dropping our reference then gives that mapping the frame back as
+ * owner (see coremap_decref), so it can be paged out again.
+ */
+static
+void
+ksm_endpass(void)
+{
+	struct ksm_node **knp, *kn;
+	unsigned i;
+
+	lock_acquire(ksm_lock);
+	for (i=0; i<KSM_NBUCKETS; i++) {
+		while ((kn = ksm_unstable[i]) != NULL) {
+			ksm_unstable[i] = kn->kn_next;
+			kfree(kn);
+		}
+
+		knp = &ksm_stable[i];
+		while ((kn = *knp) != NULL) {
+			if (coremap_getref(kn->kn_paddr) <= 2) {
+				*knp = kn->kn_next;
+				coremap_decref(kn->kn_paddr);
+				kfree(kn);
+			}
+			else {
+				knp = &kn->kn_next;
+			}
+		}
+	}
+	ksm_npasses++;
+	lock_release(ksm_lock);
+}
+
+static
+void
+ksm_thread(void *unused1, unsigned long unused2)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	unsigned budget, scanned, passscanned = 0;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		budget = ksm_scanrate;
+		while (budget > 0) {
+			paddr = coremap_pickmerge(budget, &scanned, &as, &vaddr);
+			budget -= scanned < budget ? scanned : budget;
+			ksm_nscanned += scanned;
+			passscanned += scanned;
+
+			if (paddr != 0) {
+				if (ksm_page(paddr, as, vaddr)) {
+					coremap_unbusy(paddr);
+					coremap_decref(paddr);
+					ksm_nmerged++;
+				}
+				else {
+					coremap_unbusy(paddr);
+				}
+				/* Let anything with real work to do run. */
+				thread_yield();
+			}
+			if (passscanned >= coremap_nframes()) {
+				ksm_endpass();
+				passscanned = 0;
+			}
+			if (paddr == 0) {
+				break;
+			}
+		}
+		clocksleep(1);
+	}
+}
+
+void
+ksm_bootstrap(void)
+{
+	int result;
+
+	ksm_scanrate = coremap_nframes() / KSM_SCANDIV;
+
+	ksm_lock = lock_create("ksm");
+	if (ksm_lock == NULL) {
+		panic("ksm: lock_create failed\n");
+	}
+
+	result = thread_fork("ksm", NULL, ksm_thread, NULL, 0);
+	if (result) {
+		panic("ksm: thread_fork: %s\n", strerror(result));
+	}
+}
+
+void
+ksm_setscanrate(unsigned scanrate)
+{
+	ksm_scanrate = scanrate;
+}
+
+unsigned
+ksm_getscanrate(void)
+{
+	return ksm_scanrate;
+}
+
+void
+ksm_printstats(void)
+{
+	struct ksm_node *kn;
+	unsigned i, refs, nshared = 0, nsaved = 0;
+
+	lock_acquire(ksm_lock);
+	for (i=0; i<KSM_NBUCKETS; i++) {
+		for (kn = ksm_stable[i]; kn != NULL; kn = kn->kn_next) {
+			/* One reference is the stable table's own. */
+			refs = coremap_getref(kn->kn_paddr) - 1;
+			if (refs > 0) {
+				nshared++;
+				nsaved += refs - 1;
+			}
+		}
+	}
+	lock_release(ksm_lock);
+
+	kprintf("ksm: %u frames scanned in %u passes, %u pages merged\n",
+		ksm_nscanned, ksm_npasses, ksm_nmerged);
+	kprintf("ksm: %u merged frames, %u frames saved, "
+		"scan rate %u frames/sec\n", nshared, nsaved, ksm_scanrate);
+}
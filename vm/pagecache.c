@@ -0,0 +1,176 @@
+/*
+ * Page cache for shared read-only file pages. See pagecache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PC_NBUCKETS	256
+
+struct pcentry {
+	struct vnode *pce_vnode;
+	off_t pce_offset;
+	paddr_t pce_paddr;
+	struct pcentry *pce_next;	/* hash chain */
+};
+
+/* Lock order: pc_lock before coremap_lock. */
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+static struct pcentry *pc_table[PC_NBUCKETS];
+
+/* Statistics, protected by pc_lock. */
+static unsigned pc_nframes;	/* frames in the cache */
+static unsigned pc_hits, pc_misses;
+
+static
+unsigned
+pc_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+		% PC_NBUCKETS;
+}
+
+static
+struct pcentry *
+pc_find(struct vnode *v, off_t offset)
+{
+	struct pcentry *pce;
+
+	KASSERT(spinlock_do_i_hold(&pc_lock));
+
+	for (pce = pc_table[pc_hash(v, offset)]; pce != NULL;
+	     pce = pce->pce_next) {
+		if (pce->pce_vnode == v && pce->pce_offset == offset) {
+			return pce;
+		}
+	}
+	return NULL;
+}
+
+paddr_t
+pagecache_lookup(struct vnode *v, off_t offset)
+{
+	struct pcentry *pce;
+	paddr_t paddr;
+
+	spinlock_acquire(&pc_lock);
+	pce = pc_find(v, offset);
+	if (pce == NULL) {
+		pc_misses++;
+		spinlock_release(&pc_lock);
+		return 0;
+	}
+	paddr = pce->pce_paddr;
+	coremap_incref(paddr, NULL, 0);
+	pc_hits++;
+	spinlock_release(&pc_lock);
+
+	return paddr;
+}
+
+paddr_t
+pagecache_insert(struct vnode *v, off_t offset, paddr_t paddr)
+{
+	struct pcentry *pce, *old;
+	unsigned bucket;
+
+	pce = kmalloc(sizeof(*pce));
+	if (pce == NULL) {
+		coremap_decref(paddr);
+		return 0;
+	}
+
+	spinlock_acquire(&pc_lock);
+	old = pc_find(v, offset);
+	if (old != NULL) {
+		/* Someone else read it in at the same time. */
+		coremap_incref(old->pce_paddr, NULL, 0);
+		spinlock_release(&pc_lock);
+
+		kfree(pce);
+		coremap_decref(paddr);
+		return old->pce_paddr;
+	}
+
+	pce->pce_vnode = v;
+	pce->pce_offset = offset;
+	pce->pce_paddr = paddr;
+	bucket = pc_hash(v, offset);
+	pce->pce_next = pc_table[bucket];
+	pc_table[bucket] = pce;
+
+	/* One reference for the cache, one for the caller. */
+	coremap_incref(paddr, NULL, 0);
+	pc_nframes++;
+	spinlock_release(&pc_lock);
+
+	return paddr;
+}
+
+/*
+ * Mappings are counted by the coremap reference count alone, so that
+ * as_copy can share a cached page with a plain coremap_incref. All
+ * references are dropped here, under pc_lock, so a count of 1 left
+ * after ours goes means nobody else maps the frame; and nobody can
+ * be about to, since as_copy needs an existing mapping to copy.
+ */
+void
+pagecache_release(struct vnode *v, off_t offset, paddr_t paddr)
+{
+	struct pcentry *pce, **prev;
+
+	spinlock_acquire(&pc_lock);
+	coremap_decref(paddr);
+	if (coremap_getref(paddr) > 1) {
+		spinlock_release(&pc_lock);
+		return;
+	}
+
+	for (prev = &pc_table[pc_hash(v, offset)]; *prev != NULL;
+	     prev = &(*prev)->pce_next) {
+		if ((*prev)->pce_vnode == v && (*prev)->pce_offset == offset) {
+			break;
+		}
+	}
+	pce = *prev;
+	KASSERT(pce != NULL);
+	KASSERT(pce->pce_paddr == paddr);
+	*prev = pce->pce_next;
+	pc_nframes--;
+	spinlock_release(&pc_lock);
+
+	kfree(pce);
+	/* The cache's reference. */
+	coremap_decref(paddr);
+}
+
+void
+pagecache_printstats(void)
+{
+	struct pcentry *pce;
+	unsigned nframes, nmaps, hits, misses, i;
+
+	nmaps = 0;
+	spinlock_acquire(&pc_lock);
+	for (i=0; i<PC_NBUCKETS; i++) {
+		for (pce = pc_table[i]; pce != NULL; pce = pce->pce_next) {
+			nmaps += coremap_getref(pce->pce_paddr) - 1;
+		}
+	}
+	nframes = pc_nframes;
+	hits = pc_hits;
+	misses = pc_misses;
+	spinlock_release(&pc_lock);
+
+	kprintf("page cache: %u frames, %u mappings", nframes, nmaps);
+	if (nframes > 0) {
+		kprintf(" (sharing ratio %u.%02u)", nmaps / nframes,
+			(nmaps % nframes) * 100 / nframes);
+	}
+	kprintf("\n");
+	kprintf("page cache: %u hits, %u misses\n", hits, misses);
+}
@@ -0,0 +1,144 @@
+/*
+ * Pageout daemon. See pageout.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swapfile.h>
+#include <zstore.h>
+#include <vmstats.h>
+#include <pageout.h>
+
+/* Default low watermark as a fraction of memory; high is twice it. */
+#define PAGEOUT_LOWAT_DIV	32
+#define PAGEOUT_LOWAT_MIN	4
+
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pageout_wchan;
+static bool pageout_running;	/* daemon is awake */
+
+/* Settings; changed only through pageout_set. */
+static unsigned pageout_lowat;
+static unsigned pageout_hiwat;
+static unsigned pageout_scanrate;
+
+static
+bool
+pageout_needed(void)
+{
+	return (swap_enabled() || zstore_enabled()) &&
+		coremap_nfree() < pageout_lowat;
+}
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	unsigned scanned, budget;
+	paddr_t paddr;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		spinlock_acquire(&pageout_lock);
+		pageout_running = false;
+		while (!pageout_needed()) {
+			wchan_sleep(pageout_wchan, &pageout_lock);
+		}
+		pageout_running = true;
+		spinlock_release(&pageout_lock);
+
+		vmstats_inc(VMSTAT_PAGEOUT_WAKEUPS);
+
+		budget = pageout_scanrate;
+		while (budget > 0 && coremap_nfree() < pageout_hiwat) {
+			paddr = vm_evict(budget, &scanned);
+			vmstats_add(VMSTAT_PAGEOUT_SCANNED, scanned);
+			budget -= scanned < budget ? scanned : budget;
+			if (paddr == 0) {
+				break;
+			}
+			coremap_free(paddr, 1);
+			vmstats_inc(VMSTAT_PAGEOUT_FREED);
+		}
+
+		if (coremap_nfree() < pageout_hiwat) {
+			/*
+			 * Out of budget, or nothing could go out right
+			 * now (everything recently used, shared or
+			 * busy); try again in a second.
+			 */
+			clocksleep(1);
+		}
+	}
+}
+
+void
+pageout_bootstrap(void)
+{
+	int result;
+
+	pageout_lowat = coremap_nframes() / PAGEOUT_LOWAT_DIV;
+	if (pageout_lowat < PAGEOUT_LOWAT_MIN) {
+		pageout_lowat = PAGEOUT_LOWAT_MIN;
+	}
+	pageout_hiwat = 2 * pageout_lowat;
+	/* One full sweep of the clock a second. */
+	pageout_scanrate = coremap_nframes();
+
+	pageout_wchan = wchan_create("pageout");
+	if (pageout_wchan == NULL) {
+		panic("pageout: wchan_create failed\n");
+	}
+
+	result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+	if (result) {
+		panic("pageout: thread_fork: %s\n", strerror(result));
+	}
+}
+
+void
+pageout_check(void)
+{
+	if (pageout_wchan == NULL || pageout_running || !pageout_needed()) {
+		return;
+	}
+
+	spinlock_acquire(&pageout_lock);
+	wchan_wakeone(pageout_wchan, &pageout_lock);
+	spinlock_release(&pageout_lock);
+}
+
+int
+pageout_set(unsigned lowat, unsigned hiwat, unsigned scanrate)
+{
+	if (lowat == 0 || hiwat < lowat || hiwat > coremap_nframes() ||
+	    scanrate == 0) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&pageout_lock);
+	pageout_lowat = lowat;
+	pageout_hiwat = hiwat;
+	pageout_scanrate = scanrate;
+	spinlock_release(&pageout_lock);
+
+	pageout_check();
+	return 0;
+}
+
+void
+pageout_get(unsigned *lowat, unsigned *hiwat, unsigned *scanrate)
+{
+	*lowat = pageout_lowat;
+	*hiwat = pageout_hiwat;
+	*scanrate = pageout_scanrate;
+}
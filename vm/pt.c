@@ -0,0 +1,107 @@
+/*
+ * Two-level page tables for MY_VM. See pt.h for the entry format.
+ * With options hashpt, hashpt.c is used instead.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <pt.h>
+#include "opt-hashpt.h"
+
+#if !OPT_HASHPT
+
+#define PT_ENTRIES	1024
+#define PT_L1_SHIFT	22
+#define PT_L2_SHIFT	12
+
+#define PT_L1_INDEX(va)	((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)	(((va) >> PT_L2_SHIFT) & (PT_ENTRIES - 1))
+
+/*
+ * The top level is exactly one page: 1024 pointers to second-level
+ * tables, each of which is also exactly one page of entries.
+ */
+struct pagetable {
+	pte_t *pt_dir[PT_ENTRIES];
+};
+
+/* Bytes of page tables, for pt_memory. */
+static struct spinlock pt_statlock = SPINLOCK_INITIALIZER;
+static size_t pt_bytes;
+
+static
+void
+pt_account(ssize_t nbytes)
+{
+	spinlock_acquire(&pt_statlock);
+	pt_bytes += nbytes;
+	spinlock_release(&pt_statlock);
+}
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	pt_account(sizeof(*pt));
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	KASSERT(pt != NULL);
+
+	for (i=0; i<PT_ENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+			pt_account(-(ssize_t)(PT_ENTRIES * sizeof(pte_t)));
+		}
+	}
+	kfree(pt);
+	pt_account(-(ssize_t)sizeof(*pt));
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+
+	KASSERT(pt != NULL);
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PT_ENTRIES * sizeof(pte_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PT_ENTRIES * sizeof(pte_t));
+		pt->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+		pt_account(PT_ENTRIES * sizeof(pte_t));
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+size_t
+pt_memory(void)
+{
+	return pt_bytes;
+}
+
+#endif /* !OPT_HASHPT */
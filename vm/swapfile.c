@@ -0,0 +1,198 @@
+/*
+ * Swap space. See swapfile.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swapfile.h>
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swap_vnode;	/* the raw device */
+static struct bitmap *swap_map;		/* slots in use */
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+/* Statistics, protected by swap_lock. */
+static unsigned swap_nins, swap_nouts;
+static uint64_t swap_innsecs, swap_outnsecs;
+
+int
+swap_on(const char *devname)
+{
+	struct vnode *vn;
+	struct bitmap *map;
+	struct stat st;
+	unsigned nslots;
+	int result;
+
+	if (swap_vnode != NULL) {
+		return EBUSY;
+	}
+
+	result = vfs_swapon(devname, &vn);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		VOP_DECREF(vn);
+		vfs_swapoff(devname);
+		return result;
+	}
+	nslots = st.st_size / PAGE_SIZE;
+	if (nslots == 0) {
+		VOP_DECREF(vn);
+		vfs_swapoff(devname);
+		return EINVAL;
+	}
+
+	map = bitmap_create(nslots);
+	if (map == NULL) {
+		VOP_DECREF(vn);
+		vfs_swapoff(devname);
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&swap_lock);
+	swap_map = map;
+	swap_nslots = nslots;
+	swap_nused = 0;
+	swap_vnode = vn;
+	spinlock_release(&swap_lock);
+
+	kprintf("swap: %u pages on %s\n", nslots, devname);
+	return 0;
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_map == NULL) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	result = bitmap_alloc(swap_map, slot);
+	if (result == 0) {
+		swap_nused++;
+	}
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	swap_nused--;
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between frame PADDR and swap slot SLOT, and add the
+ * time it took to the statistics.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct timespec before, after;
+	uint64_t nsecs;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	gettime(&before);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+
+	gettime(&after);
+	timespec_sub(&after, &before, &after);
+	nsecs = after.tv_sec * 1000000000ULL + after.tv_nsec;
+
+	spinlock_acquire(&swap_lock);
+	if (rw == UIO_READ) {
+		swap_nins++;
+		swap_innsecs += nsecs;
+	}
+	else {
+		swap_nouts++;
+		swap_outnsecs += nsecs;
+	}
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+int
+swap_out(paddr_t paddr, unsigned slot)
+{
+	return swap_io(paddr, slot, UIO_WRITE);
+}
+
+int
+swap_in(paddr_t paddr, unsigned slot)
+{
+	return swap_io(paddr, slot, UIO_READ);
+}
+
+void
+swap_printstats(void)
+{
+	unsigned nslots, nused, nins, nouts;
+	uint64_t innsecs, outnsecs;
+
+	spinlock_acquire(&swap_lock);
+	nslots = swap_nslots;
+	nused = swap_nused;
+	nins = swap_nins;
+	nouts = swap_nouts;
+	innsecs = swap_innsecs;
+	outnsecs = swap_outnsecs;
+	spinlock_release(&swap_lock);
+
+	if (nslots == 0) {
+		kprintf("swap: off\n");
+		return;
+	}
+	kprintf("swap: %u of %u pages in use\n", nused, nslots);
+	kprintf("swap-ins:  %u, average %llu us\n", nins,
+		nins ? innsecs / nins / 1000 : 0);
+	kprintf("swap-outs: %u, average %llu us\n", nouts,
+		nouts ? outnsecs / nouts / 1000 : 0);
+}
@@ -0,0 +1,67 @@
+/*
+ * VM event counters. See vmstats.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vmstats.h>
+
+static struct spinlock vmstats_lock = SPINLOCK_INITIALIZER;
+static unsigned long vmstats[VMSTAT_NUM];
+
+static const char *const vmstat_names[VMSTAT_NUM] = {
+	"faults",
+	"zero-filled pages",
+	"copy-on-write faults",
+	"copy-on-write copies",
+	"pages shared by as_copy",
+	"pages read from files",
+	"stack pages added on fault",
+	"pages written back to files",
+	"pageout daemon wakeups",
+	"frames scanned for page-out",
+	"frames freed by the pageout daemon",
+	"frames reclaimed directly by allocations",
+	"pages mapped by fault-around",
+};
+
+void
+vmstats_inc(unsigned stat)
+{
+	vmstats_add(stat, 1);
+}
+
+void
+vmstats_add(unsigned stat, unsigned long n)
+{
+	KASSERT(stat < VMSTAT_NUM);
+
+	spinlock_acquire(&vmstats_lock);
+	vmstats[stat] += n;
+	spinlock_release(&vmstats_lock);
+}
+
+unsigned long
+vmstats_get(unsigned stat)
+{
+	unsigned long val;
+
+	KASSERT(stat < VMSTAT_NUM);
+
+	spinlock_acquire(&vmstats_lock);
+	val = vmstats[stat];
+	spinlock_release(&vmstats_lock);
+
+	return val;
+}
+
+void
+vmstats_print(void)
+{
+	unsigned i;
+
+	for (i=0; i<VMSTAT_NUM; i++) {
+		kprintf("%-28s %lu\n", vmstat_names[i], vmstats_get(i));
+	}
+}
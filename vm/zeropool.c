@@ -0,0 +1,127 @@
+/*
+ * Pre-zeroed frame pool. See zeropool.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pageout.h>
+#include <zeropool.h>
+
+/* Largest pool size, and its share of memory. */
+#define ZP_MAX		64
+#define ZP_DIV		16
+
+static struct spinlock zp_lock = SPINLOCK_INITIALIZER;
+static paddr_t zp_frames[ZP_MAX];
+static unsigned zp_count;
+
+/* Statistics, protected by zp_lock. */
+static unsigned zp_hits, zp_misses, zp_zeroed, zp_reclaimed;
+
+static
+unsigned
+zeropool_max(void)
+{
+	unsigned max;
+
+	max = coremap_nframes() / ZP_DIV;
+	return max < ZP_MAX ? max : ZP_MAX;
+}
+
+paddr_t
+zeropool_get(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count > 0) {
+		paddr = zp_frames[--zp_count];
+		zp_hits++;
+	}
+	else {
+		zp_misses++;
+	}
+	spinlock_release(&zp_lock);
+
+	return paddr;
+}
+
+paddr_t
+zeropool_reclaim(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count > 0) {
+		paddr = zp_frames[--zp_count];
+		zp_reclaimed++;
+	}
+	spinlock_release(&zp_lock);
+
+	return paddr;
+}
+
+/*
+ * Called from the idle loop with interrupts off, so it only ever does
+ * one page: that much is all a newly runnable thread has to wait.
+ */
+bool
+zeropool_fill(void)
+{
+	unsigned lowat, hiwat, scanrate;
+	paddr_t paddr;
+
+	if (!coremap_active() || zp_count >= zeropool_max()) {
+		return false;
+	}
+	pageout_get(&lowat, &hiwat, &scanrate);
+	if (coremap_nfree() <= hiwat) {
+		return false;
+	}
+
+	paddr = coremap_alloc(1);
+	if (paddr == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count < zeropool_max()) {
+		zp_frames[zp_count++] = paddr;
+		zp_zeroed++;
+		paddr = 0;
+	}
+	spinlock_release(&zp_lock);
+
+	if (paddr != 0) {
+		/* Another cpu filled the last slot first. */
+		coremap_free(paddr, 1);
+	}
+	return true;
+}
+
+void
+zeropool_printstats(void)
+{
+	unsigned count, hits, misses, zeroed, reclaimed;
+
+	spinlock_acquire(&zp_lock);
+	count = zp_count;
+	hits = zp_hits;
+	misses = zp_misses;
+	zeroed = zp_zeroed;
+	reclaimed = zp_reclaimed;
+	spinlock_release(&zp_lock);
+
+	kprintf("Zero pool: %u/%u frames, %u zeroed while idle, "
+		"%u given back under memory pressure\n",
+		count, zeropool_max(), zeroed, reclaimed);
+	kprintf("Zero pool: %u hits, %u misses", hits, misses);
+	if (hits + misses > 0) {
+		kprintf(" (%u%% hit rate)", hits * 100 / (hits + misses));
+	}
+	kprintf("\n");
+}
@@ -0,0 +1,319 @@
+/*
+ * Compressed in-memory page store. See zstore.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <vm.h>
+#include <coremap.h>
+#include <zstore.h>
+
+/* Largest compressed page we keep. */
+#define ZS_MAXLEN	(PAGE_SIZE / 2)
+
+/*
+ * Encoding: a control byte C below 0x80 is followed by C+1 literal
+ * bytes; one of 0x80 or above is a match of (C & 0x7f) + ZS_MINMATCH
+ * bytes, followed by the distance back to copy from (1 to
+ * PAGE_SIZE-1), low byte first.
+ */
+#define ZS_MAXLIT	0x80
+#define ZS_MINMATCH	4
+#define ZS_MAXMATCH	(ZS_MINMATCH + 0x7f)
+
+/* Match finder: last position seen for each hash of 4 bytes. */
+#define ZS_HASHBITS	10
+#define ZS_NOPOS	0xffff
+
+/* Slots, and default cap (a fraction of memory), relative to RAM. */
+#define ZS_SLOTSPERFRAME	4
+#define ZS_CAPDIV		4
+
+/* Per-page ratio histogram: up to 1/16, 1/8, 1/4, 1/2 of a page. */
+#define ZS_NBUCKETS	4
+
+struct zs_slot {
+	void *zs_data;
+	unsigned zs_len;
+};
+
+/* Everything below is protected by zs_lock. */
+static struct lock *zs_lock;
+static struct bitmap *zs_map;		/* slots in use */
+static struct zs_slot *zs_slots;
+static unsigned zs_nslots;
+static unsigned zs_cap;			/* in pages */
+static size_t zs_bytes;			/* compressed bytes held */
+static unsigned zs_npages;		/* pages held */
+
+/* Scratch space for the compressor. */
+static uint16_t zs_hashtab[1 << ZS_HASHBITS];
+static uint8_t zs_buf[ZS_MAXLEN];
+
+/* Statistics */
+static unsigned zs_nouts, zs_nins, zs_nbig, zs_nfull;
+static uint64_t zs_outbytes;		/* compressed size of all stores */
+static unsigned zs_hist[ZS_NBUCKETS];
+
+static
+uint32_t
+zs_read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Append the N literal bytes at LIT to DST at OP. Returns the new
+ * output position, or ZS_MAXLEN + 1 if they don't fit.
+ */
+static
+unsigned
+zs_literals(uint8_t *dst, unsigned op, const uint8_t *lit, unsigned n)
+{
+	unsigned k;
+
+	while (n > 0) {
+		k = n < ZS_MAXLIT ? n : ZS_MAXLIT;
+		if (op + 1 + k > ZS_MAXLEN) {
+			return ZS_MAXLEN + 1;
+		}
+		dst[op++] = k - 1;
+		memcpy(dst + op, lit, k);
+		op += k;
+		lit += k;
+		n -= k;
+	}
+	return op;
+}
+
+/*
+ * Compress the page at SRC into DST. Returns the compressed length,
+ * or 0 if it would be more than ZS_MAXLEN.
+ */
+static
+unsigned
+zs_compress(const uint8_t *src, uint8_t *dst)
+{
+	unsigned ip = 0, anchor = 0, op = 0, ref, len, h, i;
+	uint32_t seq;
+
+	for (i=0; i < (1 << ZS_HASHBITS); i++) {
+		zs_hashtab[i] = ZS_NOPOS;
+	}
+
+	while (ip + ZS_MINMATCH <= PAGE_SIZE) {
+		seq = zs_read32(src + ip);
+		h = (seq * 2654435761U) >> (32 - ZS_HASHBITS);
+		ref = zs_hashtab[h];
+		zs_hashtab[h] = ip;
+		if (ref == ZS_NOPOS || zs_read32(src + ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		len = ZS_MINMATCH;
+		while (ip + len < PAGE_SIZE && len < ZS_MAXMATCH &&
+		       src[ref + len] == src[ip + len]) {
+			len++;
+		}
+
+		op = zs_literals(dst, op, src + anchor, ip - anchor);
+		if (op + 3 > ZS_MAXLEN) {
+			return 0;
+		}
+		dst[op++] = 0x80 | (len - ZS_MINMATCH);
+		dst[op++] = (ip - ref) & 0xff;
+		dst[op++] = (ip - ref) >> 8;
+		ip += len;
+		anchor = ip;
+	}
+
+	op = zs_literals(dst, op, src + anchor, PAGE_SIZE - anchor);
+	if (op > ZS_MAXLEN) {
+		return 0;
+	}
+	return op;
+}
+
+static
+void
+zs_decompress(const uint8_t *src, unsigned len, uint8_t *dst)
+{
+	unsigned ip = 0, op = 0, n, off;
+
+	while (ip < len) {
+		if (src[ip] < ZS_MAXLIT) {
+			n = src[ip++] + 1;
+			KASSERT(ip + n <= len && op + n <= PAGE_SIZE);
+			memcpy(dst + op, src + ip, n);
+			ip += n;
+			op += n;
+		}
+		else {
+			KASSERT(ip + 3 <= len);
+			n = (src[ip] & 0x7f) + ZS_MINMATCH;
+			off = src[ip + 1] | (src[ip + 2] << 8);
+			ip += 3;
+			KASSERT(off > 0 && off <= op && op + n <= PAGE_SIZE);
+			/* Byte by byte: the copy may overlap itself. */
+			while (n-- > 0) {
+				dst[op] = dst[op - off];
+				op++;
+			}
+		}
+	}
+	KASSERT(op == PAGE_SIZE);
+}
+
+void
+zstore_bootstrap(void)
+{
+	zs_nslots = coremap_nframes() * ZS_SLOTSPERFRAME;
+	zs_cap = coremap_nframes() / ZS_CAPDIV;
+
+	zs_lock = lock_create("zstore");
+	zs_map = bitmap_create(zs_nslots);
+	zs_slots = kmalloc(zs_nslots * sizeof(*zs_slots));
+	if (zs_lock == NULL || zs_map == NULL || zs_slots == NULL) {
+		panic("zstore: out of memory\n");
+	}
+}
+
+bool
+zstore_enabled(void)
+{
+	return zs_cap > 0;
+}
+
+int
+zstore_out(paddr_t paddr, unsigned *slot)
+{
+	unsigned len, bucket;
+	void *data;
+
+	lock_acquire(zs_lock);
+
+	if (zs_cap == 0 || zs_bytes >= (size_t)zs_cap * PAGE_SIZE) {
+		zs_nfull++;
+		lock_release(zs_lock);
+		return ENOSPC;
+	}
+
+	len = zs_compress((const uint8_t *)PADDR_TO_KVADDR(paddr), zs_buf);
+	if (len == 0) {
+		zs_nbig++;
+		lock_release(zs_lock);
+		return E2BIG;
+	}
+	if (zs_bytes + len > (size_t)zs_cap * PAGE_SIZE ||
+	    bitmap_alloc(zs_map, slot)) {
+		zs_nfull++;
+		lock_release(zs_lock);
+		return ENOSPC;
+	}
+
+	/* Can't page anything out from here to find room; see vm_evict. */
+	data = kmalloc(len);
+	if (data == NULL) {
+		bitmap_unmark(zs_map, *slot);
+		zs_nfull++;
+		lock_release(zs_lock);
+		return ENOMEM;
+	}
+	memcpy(data, zs_buf, len);
+
+	zs_slots[*slot].zs_data = data;
+	zs_slots[*slot].zs_len = len;
+	zs_bytes += len;
+	zs_npages++;
+
+	zs_nouts++;
+	zs_outbytes += len;
+	for (bucket = 0; len > ((unsigned)PAGE_SIZE >> (ZS_NBUCKETS - bucket));
+	     bucket++) {
+		/* nothing */
+	}
+	zs_hist[bucket]++;
+
+	lock_release(zs_lock);
+	return 0;
+}
+
+int
+zstore_in(paddr_t paddr, unsigned slot)
+{
+	lock_acquire(zs_lock);
+	KASSERT(slot < zs_nslots);
+	KASSERT(bitmap_isset(zs_map, slot));
+	zs_decompress(zs_slots[slot].zs_data, zs_slots[slot].zs_len,
+		      (uint8_t *)PADDR_TO_KVADDR(paddr));
+	zs_nins++;
+	lock_release(zs_lock);
+	return 0;
+}
+
+void
+zstore_free(unsigned slot)
+{
+	void *data;
+
+	lock_acquire(zs_lock);
+	KASSERT(slot < zs_nslots);
+	KASSERT(bitmap_isset(zs_map, slot));
+	data = zs_slots[slot].zs_data;
+	zs_bytes -= zs_slots[slot].zs_len;
+	zs_npages--;
+	zs_slots[slot].zs_data = NULL;
+	zs_slots[slot].zs_len = 0;
+	bitmap_unmark(zs_map, slot);
+	lock_release(zs_lock);
+
+	kfree(data);
+}
+
+void
+zstore_setcap(unsigned npages)
+{
+	lock_acquire(zs_lock);
+	zs_cap = npages;
+	lock_release(zs_lock);
+}
+
+unsigned
+zstore_getcap(void)
+{
+	return zs_cap;
+}
+
+void
+zstore_printstats(void)
+{
+	static const char *const bucketnames[ZS_NBUCKETS] = {
+		"1/16", "1/8", "1/4", "1/2",
+	};
+	unsigned i, ratio;
+
+	lock_acquire(zs_lock);
+
+	/* Ratios in hundredths. */
+	ratio = zs_bytes == 0 ? 0 :
+		(uint64_t)zs_npages * PAGE_SIZE * 100 / zs_bytes;
+	kprintf("Compressed store: %u pages in %u bytes (%u.%02u:1), "
+		"cap %u pages\n", zs_npages, (unsigned)zs_bytes,
+		ratio / 100, ratio % 100, zs_cap);
+	ratio = zs_outbytes == 0 ? 0 :
+		(uint64_t)zs_nouts * PAGE_SIZE * 100 / zs_outbytes;
+	kprintf("Compressed store: %u stores (%u.%02u:1), %u loads, "
+		"%u incompressible, %u refused when full\n", zs_nouts,
+		ratio / 100, ratio % 100, zs_nins, zs_nbig, zs_nfull);
+	kprintf("Compressed store: pages compressed to at most");
+	for (i=0; i<ZS_NBUCKETS; i++) {
+		kprintf(" %s: %u%s", bucketnames[i], zs_hist[i],
+			i < ZS_NBUCKETS - 1 ? "," : "\n");
+	}
+
+	lock_release(zs_lock);
+}